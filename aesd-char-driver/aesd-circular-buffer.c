@@ -16,6 +16,10 @@
 
 #include "aesd-circular-buffer.h"
 
+#if defined(AESD_CIRCULAR_BUFFER_SOA) && defined(__AVX2__) && !defined(__KERNEL__)
+#include <immintrin.h>
+#endif
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -29,31 +33,14 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    int index;
-    int offset = char_offset;
-    int entry_count = 0;
+    struct aesd_circular_buffer_iter iter;
 
     if (buffer == NULL || entry_offset_byte_rtn == NULL)
     {
         return NULL;
     }
 
-    index = buffer->out_offs;
-
-    while (entry_count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED && buffer->entry[index].size <= offset)
-    {
-        offset -= buffer->entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry_count++;
-    }
-
-    if (entry_count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {
-        *entry_offset_byte_rtn = offset;
-        return &buffer->entry[index];
-    }
-    
-    return NULL;
+    return aesd_circular_buffer_iter_seek(buffer, &iter, char_offset, entry_offset_byte_rtn);
 }
 
 /**
@@ -62,18 +49,55 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* The stored entry gets the next sequence number, and its timestamp is raised to the newest entry's if it is
+* earlier, so timestamps never decrease from the oldest entry to the newest even if the caller's clock steps back.
+* @return the buffptr of the entry that was overwritten, so the caller can free it, or NULL if none was
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    struct aesd_buffer_entry *entry;
-    int index;
-    
+    const char *evicted = NULL;
+    struct aesd_buffer_entry *stored;
+    uint64_t newest_timestamp_ns = 0;
+
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    uint64_t previous_end = 0;
+
+    if(buffer != NULL && aesd_circular_buffer_count(buffer) > 0)
+    {
+        previous_end = buffer->end[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)
+                                    % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    }
+#endif
+
     if(buffer == NULL || add_entry == NULL)
     {
-        return;
+        return NULL;
     }
 
-    buffer->entry[buffer->in_offs] = *add_entry;
+    // Keep the total up to date instead of adding up every entry again
+    if(buffer->full)
+    {
+        buffer->total_size -= buffer->entry[buffer->in_offs].size;
+        evicted = buffer->entry[buffer->in_offs].buffptr;
+    }
+    buffer->total_size += add_entry->size;
+
+    if(aesd_circular_buffer_count(buffer) > 0)
+    {
+        newest_timestamp_ns = buffer->entry[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)
+                                            % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].timestamp_ns;
+    }
+
+    stored = &buffer->entry[buffer->in_offs];
+    *stored = *add_entry;
+    stored->seq = buffer->next_seq++;
+    if(stored->timestamp_ns < newest_timestamp_ns)
+    {
+        stored->timestamp_ns = newest_timestamp_ns;
+    }
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    buffer->end[buffer->in_offs] = previous_end + add_entry->size;
+#endif
     
     buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
     
@@ -91,11 +115,7 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
         buffer->full = false;
     }
 
-    buffer->total_size = 0;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,buffer,index) {
-        if (entry) buffer->total_size += entry->size;
-    }
-    
+    return evicted;
 }
 
 /**
@@ -104,6 +124,16 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    {
+        int index;
+
+        for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
+        {
+            buffer->end[index] = AESD_CIRCULAR_BUFFER_END_UNUSED;
+        }
+    }
+#endif
 }
 
 /**
@@ -115,35 +145,224 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 struct aesd_buffer_entry *aesd_circular_buffer_get_next_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry)
 {
     int index;
-    
-    if (buffer == NULL)
+
+    if (buffer == NULL || aesd_circular_buffer_count(buffer) == 0)
     {
         return NULL;
     }
 
     if (entry == NULL)
     {
-        index = buffer->out_offs;
+        return &buffer->entry[buffer->out_offs];
     }
-    else
+
+    // The entry's ring index follows from its address, no need to scan for it
+    index = entry - buffer->entry;
+    if (index < 0 || index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        return NULL;
+    }
+
+    index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    // If we are at the in_offs, return NULL (as we have reached the end of the buffer)
+    if (index == buffer->in_offs)
     {
-        index = 0;
-        while (index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED && &buffer->entry[index] != entry)
+        return NULL;
+    }
+
+    return &buffer->entry[index];
+}
+
+/**
+ * @return the number of entries currently held by @param buffer
+ */
+uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+    {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+                % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * Position @param iter before the oldest entry of @param buffer
+ */
+void aesd_circular_buffer_iter_init(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter)
+{
+    iter->index = buffer->out_offs;
+    iter->remaining = aesd_circular_buffer_count(buffer);
+}
+
+/**
+ * @return the entry at @param iter, advancing it, or NULL once the newest entry has been returned
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_iter_next(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter)
+{
+    struct aesd_buffer_entry *entry;
+
+    if (iter->remaining == 0)
+    {
+        return NULL;
+    }
+
+    entry = &buffer->entry[iter->index];
+    iter->index = (iter->index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    iter->remaining--;
+
+    return entry;
+}
+
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+/**
+ * @return how many of the AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED offsets in @param end are at most @param target.
+ * Every slot is compared, so there are no data dependent branches. The kernel cannot use
+ * vector registers here and gets the plain loop, as do userspace builds without AVX2, where
+ * the compiler may still vectorize it.
+ */
+static unsigned int aesd_circular_buffer_count_ends(const uint64_t *end, uint64_t target)
+{
+    unsigned int count = 0;
+    int index = 0;
+
+#if defined(__AVX2__) && !defined(__KERNEL__)
+    // Offsets stay below 2^63, so the signed 64 bit compare is safe
+    __m256i targets = _mm256_set1_epi64x(target);
+    __m256i after;
+
+    for (; index + 4 <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index += 4)
+    {
+        after = _mm256_cmpgt_epi64(_mm256_load_si256((const __m256i *)&end[index]), targets);
+        count += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(after)));
+    }
+#endif
+
+    for (; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
+    {
+        count += end[index] <= target;
+    }
+
+    return count;
+}
+#endif
+
+/**
+ * Find the entry holding @param char_offset, as aesd_circular_buffer_find_entry_offset_for_fpos() does,
+ * and leave @param iter positioned after it so the following entries can be walked with
+ * aesd_circular_buffer_iter_next().
+ * @return the entry, or NULL if this position is not available in the buffer (@param iter is then exhausted)
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_iter_seek(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter, size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry;
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    uint64_t target;
+    unsigned int before;
+    int index;
+#endif
+
+    aesd_circular_buffer_iter_init(buffer, iter);
+
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    if (char_offset >= buffer->total_size)
+    {
+        iter->remaining = 0;
+        return NULL;
+    }
+
+    // The entries ending at or before the position are exactly the ones preceding its entry
+    entry = &buffer->entry[buffer->out_offs];
+    target = buffer->end[buffer->out_offs] - entry->size + char_offset;
+    before = aesd_circular_buffer_count_ends(buffer->end, target);
+
+    index = (buffer->out_offs + before) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    entry = &buffer->entry[index];
+    *entry_offset_byte_rtn = target - (buffer->end[index] - entry->size);
+
+    iter->index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    iter->remaining -= before + 1;
+    return entry;
+#else
+
+    while ((entry = aesd_circular_buffer_iter_next(buffer, iter)) != NULL)
+    {
+        if (char_offset < entry->size)
         {
-            index++;
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
         }
-    
-        // If we are at the end of the buffer, return NULL
-        if (index == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) return NULL;
-    
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        char_offset -= entry->size;
+    }
+
+    return NULL;
+#endif
+}
+
+/**
+ * Find the oldest entry added at or after @param timestamp_ns with a binary search over the entries,
+ * which works because their timestamps never decrease. @param iter is left positioned after it, as
+ * aesd_circular_buffer_iter_seek() does.
+ * @param char_offset_rtn receives the position of the first byte of that entry, or the total size of
+ * the buffer if no entry is that recent
+ * @return the entry, or NULL if every entry is older than @param timestamp_ns (@param iter is then exhausted)
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_iter_seek_time(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter, uint64_t timestamp_ns, size_t *char_offset_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    unsigned int low = 0, high, middle;
+    int index;
+#ifndef AESD_CIRCULAR_BUFFER_SOA
+    size_t char_offset = 0;
+    unsigned int before;
+#endif
+
+    aesd_circular_buffer_iter_init(buffer, iter);
 
-        // If we are at the in_offs, return NULL (as we have reached the end of the buffer)
-        if (index == buffer->in_offs)
+    // The first of the entries in [low, high) that is recent enough, high if none is
+    high = iter->remaining;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        index = (buffer->out_offs + middle) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (buffer->entry[index].timestamp_ns < timestamp_ns)
         {
-            return NULL;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
         }
     }
 
-    return &buffer->entry[index];
+    if (low == iter->remaining)
+    {
+        iter->remaining = 0;
+        *char_offset_rtn = buffer->total_size;
+        return NULL;
+    }
+
+    index = (buffer->out_offs + low) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    entry = &buffer->entry[index];
+
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    // The end offsets give the position directly
+    *char_offset_rtn = (buffer->end[index] - entry->size)
+                     - (buffer->end[buffer->out_offs] - buffer->entry[buffer->out_offs].size);
+#else
+    for (before = 0; before < low; before++)
+    {
+        char_offset += aesd_circular_buffer_iter_next(buffer, iter)->size;
+    }
+    *char_offset_rtn = char_offset;
+#endif
+
+    iter->index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    iter->remaining = aesd_circular_buffer_count(buffer) - low - 1;
+    return entry;
 }
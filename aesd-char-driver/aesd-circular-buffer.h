@@ -16,7 +16,26 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Can be overridden at compile time (up to 255, the range of in_offs/out_offs),
+ * which the userspace benchmarks use to compare capacities
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+/**
+ * Define AESD_CIRCULAR_BUFFER_SOA to also keep the end offset of every entry in
+ * a separate, cache line aligned array. Position lookups then only read that
+ * array and count the entries ending before the position, which vectorizes,
+ * instead of walking the entries one by one. Adding an entry stays O(1).
+ */
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+/**
+ * End offset stored in unused slots, larger than any position so they are never counted
+ */
+#define AESD_CIRCULAR_BUFFER_END_UNUSED (~0ULL >> 1)
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +47,23 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * When the entry was added, in nanoseconds. Never less than the timestamp of the
+     * entry before it, aesd_circular_buffer_add_entry() makes sure of that.
+     */
+    uint64_t timestamp_ns;
+    /**
+     * Position of the entry among all entries ever added to the buffer, starting at 0.
+     * Set by aesd_circular_buffer_add_entry().
+     */
+    uint64_t seq;
+#ifdef AESDCHAR_COMPRESS
+    /**
+     * Number of bytes buffptr holds when it is LZ4 compressed, 0 when it holds the
+     * size bytes as is. Offsets are always counted in uncompressed bytes.
+     */
+    size_t stored_size;
+#endif
 };
 
 struct aesd_circular_buffer
@@ -53,17 +89,59 @@ struct aesd_circular_buffer
      * The total size of the buffer
      */
     size_t total_size;
+    /**
+     * Sequence number the next entry added will get
+     */
+    uint64_t next_seq;
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+    /**
+     * Offset just past each entry, indexed like entry[] and counted from the first byte
+     * ever added, so it keeps increasing from the oldest entry to the newest
+     */
+    uint64_t end[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] __attribute__((aligned(64)));
+#endif
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_get_next_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry);
 
+/**
+ * A cursor over the valid entries of a buffer, from oldest to newest.
+ * It holds the ring index, so advancing is O(1). The buffer must not be
+ * modified while a cursor is in use.
+ */
+struct aesd_circular_buffer_iter
+{
+    /**
+     * Ring index of the next entry to return
+     */
+    uint8_t index;
+    /**
+     * Number of entries left to return
+     */
+    uint8_t remaining;
+};
+
+extern uint8_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_iter_init(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_iter_next(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_iter_seek(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter, size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_iter_seek_time(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_iter *iter, uint64_t timestamp_ns, size_t *char_offset_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -83,6 +161,18 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_get_next_entry(struct aesd
             index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
             index++, entryptr=&((buffer)->entry[index]))
 
-
+/**
+ * Like AESD_CIRCULAR_BUFFER_FOREACH, but only visits the entries currently
+ * held by the buffer, oldest first.
+ * @param iter is a struct aesd_circular_buffer_iter stack allocated value used by this macro
+ * Example usage:
+ * struct aesd_circular_buffer_iter iter;
+ * AESD_CIRCULAR_BUFFER_FOREACH_VALID(entry,&buffer,iter) {
+ *      total += entry->size;
+ * }
+ */
+#define AESD_CIRCULAR_BUFFER_FOREACH_VALID(entryptr,buffer,iter) \
+    for(aesd_circular_buffer_iter_init((buffer), &(iter)); \
+            ((entryptr) = aesd_circular_buffer_iter_next((buffer), &(iter))) != NULL; )
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
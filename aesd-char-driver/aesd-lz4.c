@@ -0,0 +1,256 @@
+/**
+ * @file aesd-lz4.c
+ * @brief LZ4 block format codec for userspace builds of the driver
+ *
+ * The kernel has its own in lib/lz4. This one is a plain greedy compressor
+ * with a single hash table, which trades some ratio for staying short, and a
+ * bounds checked decompressor. Its output is standard LZ4 block format.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aesd-lz4.h"
+
+#define LZ4_MINMATCH 4
+// The last match must start this many bytes before the end of the input
+#define LZ4_MFLIMIT 12
+// and the last bytes are always literals
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_RUN_MASK 15
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * @return the bytes needed to encode a length of at least LZ4_RUN_MASK past the token
+ */
+static size_t lz4_length_size(size_t length)
+{
+    return length < LZ4_RUN_MASK ? 0 : (length - LZ4_RUN_MASK) / 255 + 1;
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t length)
+{
+    if (length < LZ4_RUN_MASK)
+    {
+        return op;
+    }
+    length -= LZ4_RUN_MASK;
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/**
+ * Write literals followed, unless match_length is negative, by a match
+ * @return the end of the sequence, or NULL if it does not fit before oend
+ */
+static uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t literal_length,
+            size_t offset, long match_length)
+{
+    size_t needed = 1 + lz4_length_size(literal_length) + literal_length;
+    uint8_t *token = op;
+
+    if (match_length >= 0)
+    {
+        needed += 2 + lz4_length_size(match_length);
+    }
+    if (needed > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+
+    *token = (literal_length < LZ4_RUN_MASK ? literal_length : LZ4_RUN_MASK) << 4;
+    op = lz4_write_length(op + 1, literal_length);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length >= 0)
+    {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        *token |= match_length < LZ4_RUN_MASK ? match_length : LZ4_RUN_MASK;
+        op = lz4_write_length(op, match_length);
+    }
+
+    return op;
+}
+
+int LZ4_compress_default(const char *source, char *dest, int inputSize, int maxOutputSize, void *wrkmem)
+{
+    uint32_t *table = wrkmem;
+    const uint8_t *base = (const uint8_t *)source;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + inputSize;
+    const uint8_t *match, *match_end;
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *oend = op + maxOutputSize;
+    uint32_t sequence, hash;
+    size_t offset;
+
+    if (inputSize < 0 || inputSize > LZ4_MAX_INPUT_SIZE || maxOutputSize <= 0)
+    {
+        return 0;
+    }
+
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+    // Inputs too short to hold a match are all literals
+    while (inputSize > LZ4_MFLIMIT && ip < iend - LZ4_MFLIMIT)
+    {
+        sequence = lz4_read32(ip);
+        hash = lz4_hash(sequence);
+        match = base + table[hash];
+        table[hash] = ip - base;
+
+        // The table only holds positions, a different sequence with the same hash is caught here
+        if (match >= ip || ip - match > LZ4_MAX_DISTANCE || lz4_read32(match) != sequence)
+        {
+            ip++;
+            continue;
+        }
+
+        // Take over matching bytes before the sequence from the literals
+        while (ip > anchor && match > base && ip[-1] == match[-1])
+        {
+            ip--;
+            match--;
+        }
+
+        offset = ip - match;
+        match_end = ip + LZ4_MINMATCH;
+        match += LZ4_MINMATCH;
+        while (match_end < iend - LZ4_LASTLITERALS && *match_end == *match)
+        {
+            match_end++;
+            match++;
+        }
+
+        op = lz4_write_sequence(op, oend, anchor, ip - anchor, offset, match_end - ip - LZ4_MINMATCH);
+        if (op == NULL)
+        {
+            return 0;
+        }
+
+        ip = match_end;
+        anchor = ip;
+    }
+
+    op = lz4_write_sequence(op, oend, anchor, iend - anchor, 0, -1);
+    if (op == NULL)
+    {
+        return 0;
+    }
+
+    return op - (uint8_t *)dest;
+}
+
+int LZ4_decompress_safe(const char *source, char *dest, int compressedSize, int maxDecompressedSize)
+{
+    const uint8_t *ip = (const uint8_t *)source;
+    const uint8_t *iend = ip + compressedSize;
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *oend = op + maxDecompressedSize;
+    const uint8_t *match;
+    size_t length, offset;
+    uint8_t token, byte;
+
+    if (compressedSize <= 0 || maxDecompressedSize < 0)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        token = *ip++;
+
+        length = token >> 4;
+        if (length == LZ4_RUN_MASK)
+        {
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+        }
+        if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        // The last sequence has no match
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest))
+        {
+            return -1;
+        }
+
+        length = token & LZ4_RUN_MASK;
+        if (length == LZ4_RUN_MASK)
+        {
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+        }
+        length += LZ4_MINMATCH;
+        if (length > (size_t)(oend - op))
+        {
+            return -1;
+        }
+
+        // Byte by byte, the match may overlap what it is producing
+        match = op - offset;
+        while (length--)
+        {
+            *op++ = *match++;
+        }
+
+        if (ip >= iend)
+        {
+            return -1;
+        }
+    }
+
+    return op - (uint8_t *)dest;
+}
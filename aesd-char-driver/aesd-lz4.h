@@ -0,0 +1,43 @@
+/*
+ * aesd-lz4.h
+ *
+ * LZ4 block compression for the driver. The kernel build uses lib/lz4 and
+ * userspace builds get aesd-lz4.c, a small codec producing and reading the
+ * same block format through the same functions, so aesdchar-fops.c calls
+ * them the same way in both.
+ */
+
+#ifndef AESD_LZ4_H
+#define AESD_LZ4_H
+
+#ifdef __KERNEL__
+#include <linux/lz4.h>
+#else
+
+/**
+ * Size of the work memory LZ4_compress_default() needs, as in the kernel
+ */
+#define LZ4_MEM_COMPRESS 16384
+
+#define LZ4_MAX_INPUT_SIZE 0x7E000000
+
+/**
+ * Largest compressed size of isize bytes, for incompressible input
+ */
+#define LZ4_compressBound(isize) \
+    ((unsigned int)(isize) > (unsigned int)LZ4_MAX_INPUT_SIZE ? 0 : (isize) + ((isize) / 255) + 16)
+
+/**
+ * @return the number of bytes written to dest, or 0 if they would not fit in maxOutputSize
+ */
+int LZ4_compress_default(const char *source, char *dest, int inputSize, int maxOutputSize, void *wrkmem);
+
+/**
+ * @return the number of bytes decompressed into dest, or a negative value if source is malformed
+ * or would decompress to more than maxDecompressedSize bytes
+ */
+int LZ4_decompress_safe(const char *source, char *dest, int compressedSize, int maxDecompressedSize);
+
+#endif
+
+#endif /* AESD_LZ4_H */
@@ -0,0 +1,222 @@
+/*
+ * aesd-ring.h
+ *
+ * Header-only ring buffer, generic over the element type. Usable from the
+ * kernel, from userspace C and, through the template at the end, from C++.
+ *
+ * AESD_RING_DEFINE(name, type, capacity, policy) defines struct name with
+ * the capacity fixed at compile time. AESD_RING_DEFINE_DYNAMIC(name, type,
+ * policy) defines one whose storage and capacity are supplied at init. Both
+ * generate the same set of static inline functions prefixed with name:
+ *   name_init(), name_capacity(), name_count(), name_empty(), name_full(),
+ *   name_push(), name_pop(), name_peek(), name_at()
+ *
+ * policy decides what pushing onto a full ring does: AESD_RING_REJECT fails
+ * the push, AESD_RING_OVERWRITE drops the oldest element to make room.
+ * Elements are copied in and out by value. The ring does no locking and no
+ * allocation.
+ *
+ * Example:
+ * AESD_RING_DEFINE(int_ring, int, 16, AESD_RING_OVERWRITE)
+ * struct int_ring ring;
+ * int_ring_init(&ring);
+ * int_ring_push(&ring, &value, NULL);
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdbool.h>
+#endif
+
+enum aesd_ring_policy
+{
+    AESD_RING_REJECT,
+    AESD_RING_OVERWRITE,
+};
+
+enum aesd_ring_push_result
+{
+    AESD_RING_PUSHED,   /* Stored, nothing was dropped */
+    AESD_RING_EVICTED,  /* Stored after dropping the oldest element */
+    AESD_RING_FULL,     /* Not stored, the ring is full and rejects pushes */
+};
+
+/**
+ * Wrap an index that is less than twice the capacity, cheaper than a modulo
+ * when the capacity is only known at runtime
+ */
+static inline size_t aesd_ring_wrap(size_t index, size_t capacity)
+{
+    return index >= capacity ? index - capacity : index;
+}
+
+#define AESD_RING_DEFINE(name, type, capacity, policy) \
+    struct name \
+    { \
+        size_t head; \
+        size_t count; \
+        type items[capacity]; \
+    }; \
+    static inline void name##_init(struct name *ring) \
+    { \
+        ring->head = 0; \
+        ring->count = 0; \
+    } \
+    static inline size_t name##_capacity(const struct name *ring) \
+    { \
+        (void)ring; \
+        return (capacity); \
+    } \
+    AESD_RING_DEFINE_FUNCTIONS(name, type, policy)
+
+#define AESD_RING_DEFINE_DYNAMIC(name, type, policy) \
+    struct name \
+    { \
+        size_t head; \
+        size_t count; \
+        size_t capacity; \
+        type *items; \
+    }; \
+    /* storage must hold capacity elements, capacity must not be 0 */ \
+    static inline void name##_init(struct name *ring, type *storage, size_t capacity) \
+    { \
+        ring->head = 0; \
+        ring->count = 0; \
+        ring->capacity = capacity; \
+        ring->items = storage; \
+    } \
+    static inline size_t name##_capacity(const struct name *ring) \
+    { \
+        return ring->capacity; \
+    } \
+    AESD_RING_DEFINE_FUNCTIONS(name, type, policy)
+
+#define AESD_RING_DEFINE_FUNCTIONS(name, type, policy) \
+    static inline size_t name##_count(const struct name *ring) \
+    { \
+        return ring->count; \
+    } \
+    static inline bool name##_empty(const struct name *ring) \
+    { \
+        return ring->count == 0; \
+    } \
+    static inline bool name##_full(const struct name *ring) \
+    { \
+        return ring->count == name##_capacity(ring); \
+    } \
+    /* The index-th element from the oldest, index must be less than the count */ \
+    static inline type *name##_at(struct name *ring, size_t index) \
+    { \
+        return &ring->items[aesd_ring_wrap(ring->head + index, name##_capacity(ring))]; \
+    } \
+    /* The oldest element, or NULL when empty */ \
+    static inline type *name##_peek(struct name *ring) \
+    { \
+        return ring->count ? &ring->items[ring->head] : NULL; \
+    } \
+    /* evicted, if not NULL, receives the element dropped by AESD_RING_OVERWRITE */ \
+    static inline enum aesd_ring_push_result name##_push(struct name *ring, const type *item, type *evicted) \
+    { \
+        enum aesd_ring_push_result result = AESD_RING_PUSHED; \
+        if (name##_full(ring)) { \
+            if ((policy) == AESD_RING_REJECT) { \
+                return AESD_RING_FULL; \
+            } \
+            if (evicted) { \
+                *evicted = ring->items[ring->head]; \
+            } \
+            ring->head = aesd_ring_wrap(ring->head + 1, name##_capacity(ring)); \
+            ring->count--; \
+            result = AESD_RING_EVICTED; \
+        } \
+        ring->items[aesd_ring_wrap(ring->head + ring->count, name##_capacity(ring))] = *item; \
+        ring->count++; \
+        return result; \
+    } \
+    /* Remove the oldest element into item (if not NULL), false when empty */ \
+    static inline bool name##_pop(struct name *ring, type *item) \
+    { \
+        if (ring->count == 0) { \
+            return false; \
+        } \
+        if (item) { \
+            *item = ring->items[ring->head]; \
+        } \
+        ring->head = aesd_ring_wrap(ring->head + 1, name##_capacity(ring)); \
+        ring->count--; \
+        return true; \
+    }
+
+/**
+ * Iterate over the elements from oldest to newest
+ * @param index is a size_t used by this macro
+ * @param ptr is set to a type * for each element
+ */
+#define AESD_RING_FOREACH(name, ring, index, ptr) \
+    for ((index) = 0; (index) < name##_count(ring) && (((ptr) = name##_at((ring), (index))), 1); (index)++)
+
+#ifdef __cplusplus
+/**
+ * The same ring for C++ code such as tests and fuzzers, with the capacity
+ * fixed at compile time. Mirrors the functions generated above.
+ */
+template <typename T, size_t Capacity, aesd_ring_policy Policy = AESD_RING_REJECT>
+class aesd_ring
+{
+    static_assert(Capacity > 0, "aesd_ring needs a capacity");
+
+public:
+    size_t capacity() const { return Capacity; }
+    size_t count() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    bool full() const { return count_ == Capacity; }
+
+    T &at(size_t index) { return items_[aesd_ring_wrap(head_ + index, Capacity)]; }
+    T *peek() { return count_ ? &items_[head_] : nullptr; }
+
+    aesd_ring_push_result push(const T &item, T *evicted = nullptr)
+    {
+        aesd_ring_push_result result = AESD_RING_PUSHED;
+
+        if (full()) {
+            if (Policy == AESD_RING_REJECT) {
+                return AESD_RING_FULL;
+            }
+            if (evicted) {
+                *evicted = items_[head_];
+            }
+            head_ = aesd_ring_wrap(head_ + 1, Capacity);
+            count_--;
+            result = AESD_RING_EVICTED;
+        }
+        items_[aesd_ring_wrap(head_ + count_, Capacity)] = item;
+        count_++;
+        return result;
+    }
+
+    bool pop(T *item = nullptr)
+    {
+        if (count_ == 0) {
+            return false;
+        }
+        if (item) {
+            *item = items_[head_];
+        }
+        head_ = aesd_ring_wrap(head_ + 1, Capacity);
+        count_--;
+        return true;
+    }
+
+private:
+    size_t head_ = 0;
+    size_t count_ = 0;
+    T items_[Capacity];
+};
+#endif
+
+#endif /* AESD_RING_H */
@@ -33,14 +33,36 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed with AESDCHAR_IOCSEEKTIME to seek to the oldest command written at or after a point in time
+ */
+struct aesd_seektime {
+    /**
+     * In: the point in time, in nanoseconds since the Unix epoch (CLOCK_REALTIME)
+     */
+    uint64_t timestamp_ns;
+    /**
+     * Out: the timestamp the command was stamped with when it was written
+     */
+    uint64_t found_timestamp_ns;
+    /**
+     * Out: the sequence number of the command, counting every command ever written to the device.
+     * If no command is that recent, the file position is set to the end of the data and this is the
+     * sequence number the next command will get.
+     */
+    uint64_t seq;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Seek by time rather than by command index, command number 2
+#define AESDCHAR_IOCSEEKTIME _IOWR(AESD_IOC_MAGIC, 2, struct aesd_seektime)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,179 @@
+/*
+ * aesdchar-emu.h
+ *
+ * Minimal userspace stand-ins for the kernel APIs used by aesdchar-fops.c,
+ * so the driver's file operations can be built into a library and exercised
+ * without loading the module. Only what the driver actually uses is provided,
+ * with the kernel's return conventions (mutex_trylock returns 1 on success,
+ * copy_*_user return the number of bytes not copied).
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESDCHAR_EMU_H_
+#define AESD_CHAR_DRIVER_AESDCHAR_EMU_H_
+
+#ifdef __KERNEL__
+#error "aesdchar-emu.h is for userspace builds only"
+#endif
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define __user
+
+#ifndef ERESTARTSYS
+#define ERESTARTSYS 512
+#endif
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define GFP_KERNEL 0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+    (void)flags;
+    return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+    (void)flags;
+    return calloc(1, size);
+}
+
+static inline void *krealloc(const void *ptr, size_t size, int flags)
+{
+    (void)flags;
+    return realloc((void *)ptr, size);
+}
+
+static inline void kfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+struct mutex
+{
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock)
+{
+    pthread_mutex_init(&lock->m, NULL);
+}
+
+static inline void mutex_destroy(struct mutex *lock)
+{
+    pthread_mutex_destroy(&lock->m);
+}
+
+static inline int mutex_trylock(struct mutex *lock)
+{
+    return pthread_mutex_trylock(&lock->m) == 0;
+}
+
+// Userspace threads are never interrupted by a signal here, so this always succeeds
+static inline int mutex_lock_interruptible(struct mutex *lock)
+{
+    pthread_mutex_lock(&lock->m);
+    return 0;
+}
+
+static inline void mutex_unlock(struct mutex *lock)
+{
+    pthread_mutex_unlock(&lock->m);
+}
+
+typedef struct
+{
+    atomic_llong counter;
+} atomic64_t;
+
+static inline void atomic64_inc(atomic64_t *v)
+{
+    atomic_fetch_add_explicit(&v->counter, 1, memory_order_relaxed);
+}
+
+static inline long long atomic64_read(const atomic64_t *v)
+{
+    return atomic_load_explicit((atomic_llong *)&v->counter, memory_order_relaxed);
+}
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline u64 ktime_get_real_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/*
+ * Only the members the driver touches. A caller opens the device by pointing
+ * inode.i_cdev at the cdev member of its struct aesd_dev.
+ */
+struct cdev
+{
+    int unused;
+};
+
+struct inode
+{
+    struct cdev *i_cdev;
+};
+
+struct file
+{
+    void *private_data;
+    loff_t f_pos;
+};
+
+struct dentry;
+
+// Tracepoints compile away
+static inline void trace_aesd_read(size_t count, loff_t pos, ssize_t retval) { }
+static inline void trace_aesd_write(size_t count, loff_t pos, ssize_t retval, bool committed) { }
+static inline void trace_aesd_llseek(loff_t off, int whence, loff_t retval) { }
+static inline void trace_aesd_seekto(u32 write_cmd, u32 write_cmd_offset, loff_t pos, long retval) { }
+static inline void trace_aesd_seektime(u64 timestamp_ns, u64 seq, loff_t pos) { }
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_EMU_H_ */
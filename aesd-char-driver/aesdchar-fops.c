@@ -0,0 +1,596 @@
+/**
+ * @file aesdchar-fops.c
+ * @brief File operations of the AESD char driver
+ *
+ * Kept apart from the module setup in main.c so the same code can also be
+ * built in userspace against aesdchar-emu.h, see benchmark/aesdchar-stress.c.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#else
+#include "aesdchar-emu.h"
+#endif
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#include "aesdchar.h"
+
+#ifdef AESDCHAR_COMPRESS
+#include "aesd-lz4.h"
+#endif
+
+#ifdef __KERNEL__
+#include "aesdchar-trace.h"
+#endif
+
+/**
+ * Initialize the AESD specific portion of the device
+ */
+void aesd_dev_init(struct aesd_dev *dev)
+{
+    memset(dev, 0, sizeof(struct aesd_dev));
+    mutex_init(&dev->lock);
+    aesd_circular_buffer_init(&dev->buffer);
+}
+
+/**
+ * Free everything still held by the device, no file may be open on it anymore
+ */
+void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+
+    // Free memory allocated for circular buffer entries, once per shared payload
+    AESD_CIRCULAR_BUFFER_FOREACH_VALID(entry,&dev->buffer,iter) {
+        if (--aesd_payload_of(entry->buffptr)->refcount == 0) {
+            kfree(aesd_payload_of(entry->buffptr));
+        }
+    }
+
+    mutex_destroy(&dev->lock);
+}
+
+/**
+ * Take the device lock, counting how often it was already held by someone else
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    if (mutex_trylock(&dev->lock)) {
+        return 0;
+    }
+    atomic64_inc(&dev->stats.lock_contended);
+    return mutex_lock_interruptible(&dev->lock);
+}
+
+static void aesd_latency_record(struct aesd_latency_hist *hist, u64 start_ns)
+{
+    int bucket = fls64(ktime_get_ns() - start_ns);
+
+    if (bucket >= AESD_LATENCY_BUCKETS) {
+        bucket = AESD_LATENCY_BUCKETS - 1;
+    }
+    atomic64_inc(&hist->buckets[bucket]);
+}
+
+/**
+ * @return the number of bytes buffptr of entry holds
+ */
+static size_t aesd_stored_size(const struct aesd_buffer_entry *entry)
+{
+#ifdef AESDCHAR_COMPRESS
+    if (entry->stored_size) {
+        return entry->stored_size;
+    }
+#endif
+    return entry->size;
+}
+
+/**
+ * 64-bit FNV-1a, only used to tell apart most payloads that differ without comparing them
+ */
+static u64 aesd_payload_hash(const char *data, size_t size)
+{
+    u64 hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @return the data of a payload in the ring storing the same bytes as entry, or NULL if there is
+ * none. Called with the device lock held.
+ */
+static const char *aesd_payload_find(struct aesd_dev *dev, const struct aesd_buffer_entry *entry, u64 hash)
+{
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *other;
+    size_t stored_size = aesd_stored_size(entry);
+
+    AESD_CIRCULAR_BUFFER_FOREACH_VALID(other,&dev->buffer,iter) {
+        if (other->size == entry->size && aesd_stored_size(other) == stored_size &&
+                aesd_payload_of(other->buffptr)->hash == hash &&
+                memcmp(other->buffptr, entry->buffptr, stored_size) == 0) {
+            return other->buffptr;
+        }
+    }
+    return NULL;
+}
+
+#ifdef AESDCHAR_COMPRESS
+/**
+ * Make room for size bytes in the scratch buffer of the file, called with file->lock held
+ */
+static int aesd_scratch_reserve(struct aesd_file *file, size_t size)
+{
+    char *scratch;
+
+    if (size <= file->scratch_capacity) {
+        return 0;
+    }
+
+    // The contents are not kept, so krealloc would copy them for nothing
+    scratch = kmalloc(size, GFP_KERNEL);
+    if (!scratch) {
+        return -ENOMEM;
+    }
+    kfree(file->scratch);
+    file->scratch = scratch;
+    file->scratch_capacity = size;
+    file->scratch_valid = false;
+    return 0;
+}
+
+/**
+ * Compress the staged command, called with file->lock held.
+ * @return the data of a new payload holding *stored_size compressed bytes, or file->pending
+ * itself, with *stored_size set to 0, when the command is short, does not compress or memory is short
+ */
+static const char *aesd_compress(struct aesd_file *file, size_t *stored_size)
+{
+    size_t size = file->pending_size;
+    int bound, compressed;
+    struct aesd_payload *payload;
+
+    *stored_size = 0;
+    if (size < AESDCHAR_COMPRESS_MIN_SIZE || size > LZ4_MAX_INPUT_SIZE) {
+        return file->pending;
+    }
+
+    if (!file->workmem) {
+        file->workmem = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!file->workmem) {
+            return file->pending;
+        }
+    }
+
+    bound = LZ4_compressBound(size);
+    if (aesd_scratch_reserve(file, bound)) {
+        return file->pending;
+    }
+    file->scratch_valid = false;
+
+    compressed = LZ4_compress_default(file->pending, file->scratch, size, bound, file->workmem);
+    if (compressed <= 0 || (size_t)compressed >= size) {
+        return file->pending;
+    }
+
+    // Keep only as much memory as the compressed command needs
+    payload = kmalloc(sizeof(struct aesd_payload) + compressed, GFP_KERNEL);
+    if (!payload) {
+        return file->pending;
+    }
+    memcpy(payload->data, file->scratch, compressed);
+    *stored_size = compressed;
+    return payload->data;
+}
+
+/**
+ * Point *data at the uncompressed contents of entry, called with file->lock and the device lock held
+ */
+static int aesd_entry_data(struct aesd_file *file, const struct aesd_buffer_entry *entry, const char **data)
+{
+    int retval;
+
+    if (!entry->stored_size) {
+        *data = entry->buffptr;
+        return 0;
+    }
+
+    // Sequence numbers are never reused, so the same one means the same entry
+    if (!file->scratch_valid || file->scratch_seq != entry->seq) {
+        retval = aesd_scratch_reserve(file, entry->size);
+        if (retval) {
+            return retval;
+        }
+        if (LZ4_decompress_safe(entry->buffptr, file->scratch, entry->stored_size, entry->size) != entry->size) {
+            file->scratch_valid = false;
+            return -EIO;
+        }
+        file->scratch_seq = entry->seq;
+        file->scratch_valid = true;
+    }
+
+    *data = file->scratch;
+    return 0;
+}
+#endif
+
+int aesd_open(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file;
+
+    PDEBUG("open");
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    mutex_init(&file->lock);
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
+    return 0;
+}
+
+int aesd_release(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file = filp->private_data;
+
+    PDEBUG("release");
+    // A partial command that was never completed is dropped with the file
+    if (file->pending) {
+        kfree(aesd_payload_of(file->pending));
+    }
+#ifdef AESDCHAR_COMPRESS
+    kfree(file->scratch);
+    kfree(file->workmem);
+#endif
+    mutex_destroy(&file->lock);
+    kfree(file);
+    return 0;
+}
+
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    const char *data;
+    size_t entry_offset = 0;
+    size_t bytes_copied = 0;
+    size_t chunk;
+    ssize_t retval;
+    u64 start_ns = ktime_get_ns();
+
+#ifdef AESDCHAR_COMPRESS
+    // Compressed entries are decompressed into the file's scratch buffer
+    if (mutex_lock_interruptible(&file->lock)) {
+        trace_aesd_read(count, *f_pos, -ERESTARTSYS);
+        return -ERESTARTSYS;
+    }
+#endif
+
+    if (aesd_lock(dev)) {
+        retval = -ERESTARTSYS;
+        goto out_file;
+    }
+
+    // Find the buffer entry corresponding to the file position, NULL if it is past the end of the data
+    entry = count ? aesd_circular_buffer_iter_seek(&dev->buffer, &iter, *f_pos, &entry_offset) : NULL;
+
+    // Copy from there on, stopping at count even in the middle of an entry
+    while (entry && bytes_copied < count) {
+        data = entry->buffptr;
+#ifdef AESDCHAR_COMPRESS
+        retval = aesd_entry_data(file, entry, &data);
+        if (retval) {
+            goto out;
+        }
+#endif
+        chunk = min(entry->size - entry_offset, count - bytes_copied);
+        if (copy_to_user(buf + bytes_copied, data + entry_offset, chunk)) {
+            retval = -EFAULT;
+            goto out;
+        }
+        bytes_copied += chunk;
+        entry_offset = 0;
+
+        entry = aesd_circular_buffer_iter_next(&dev->buffer, &iter);
+    }
+    retval = bytes_copied;
+
+out:
+    mutex_unlock(&dev->lock);
+out_file:
+#ifdef AESDCHAR_COMPRESS
+    mutex_unlock(&file->lock);
+#endif
+
+    trace_aesd_read(count, *f_pos, retval);
+    if (retval >= 0) {
+        aesd_latency_record(&dev->stats.read_latency, start_ns);
+        *f_pos += retval;
+    }
+
+    return retval;
+}
+
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry entry;
+    const char *evicted;
+    const char *shared;
+    const char *unused = NULL;
+    struct aesd_payload *payload;
+    size_t capacity;
+    u64 hash;
+    u64 start_ns = ktime_get_ns();
+
+    if (count == 0) {
+        trace_aesd_write(count, *f_pos, 0, false);
+        return 0;
+    }
+
+    if (mutex_lock_interruptible(&file->lock)) {
+        trace_aesd_write(count, *f_pos, -ERESTARTSYS, false);
+        return -ERESTARTSYS;
+    }
+
+    // Stage the data with whatever this file wrote before without a newline,
+    // none of this needs the device lock. It is staged in a payload, so it can
+    // go to the ring as it is.
+    if (file->pending_size + count > file->pending_capacity) {
+        capacity = max(file->pending_capacity * 2, file->pending_size + count);
+        payload = krealloc(file->pending ? aesd_payload_of(file->pending) : NULL,
+                           sizeof(struct aesd_payload) + capacity, GFP_KERNEL);
+        if (!payload) {
+            mutex_unlock(&file->lock);
+            trace_aesd_write(count, *f_pos, -ENOMEM, false);
+            return -ENOMEM;
+        }
+        file->pending = payload->data;
+        file->pending_capacity = capacity;
+    }
+
+    if (copy_from_user(file->pending + file->pending_size, buf, count)) {
+        mutex_unlock(&file->lock);
+        trace_aesd_write(count, *f_pos, -EFAULT, false);
+        return -EFAULT;
+    }
+    file->pending_size += count;
+
+    // A command is complete when a write ends in a newline, until then keep staging
+    if (file->pending[file->pending_size - 1] != '\n') {
+        mutex_unlock(&file->lock);
+        trace_aesd_write(count, *f_pos, count, false);
+        aesd_latency_record(&dev->stats.write_latency, start_ns);
+        return count;
+    }
+
+#ifdef AESDCHAR_COMPRESS
+    // Compressed before taking the device lock, only the ring update needs it
+    entry.buffptr = aesd_compress(file, &entry.stored_size);
+#else
+    entry.buffptr = file->pending;
+#endif
+    entry.size = file->pending_size;
+    hash = aesd_payload_hash(entry.buffptr, aesd_stored_size(&entry));
+
+    if (aesd_lock(dev)) {
+        // The write will be restarted, so forget its bytes
+        if (entry.buffptr != file->pending) {
+            kfree(aesd_payload_of(entry.buffptr));
+        }
+        file->pending_size -= count;
+        mutex_unlock(&file->lock);
+        trace_aesd_write(count, *f_pos, -ERESTARTSYS, false);
+        return -ERESTARTSYS;
+    }
+
+    // A command the ring already holds shares its payload, otherwise this one becomes a payload
+    shared = aesd_payload_find(dev, &entry, hash);
+    if (shared) {
+        aesd_payload_of(shared)->refcount++;
+        if (entry.buffptr != file->pending) {
+            unused = entry.buffptr;
+        }
+        entry.buffptr = shared;
+    } else {
+        payload = aesd_payload_of(entry.buffptr);
+        payload->hash = hash;
+        payload->refcount = 1;
+    }
+
+    // Hand the command over to the ring, stamped with the wall clock so readers
+    // can seek to a point in time with AESDCHAR_IOCSEEKTIME
+    entry.timestamp_ns = ktime_get_real_ns();
+    evicted = aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+
+    // The oldest command dropped to make room may still be shared by newer ones
+    payload = evicted ? aesd_payload_of(evicted) : NULL;
+    if (payload && --payload->refcount > 0) {
+        payload = NULL;
+    }
+
+    mutex_unlock(&dev->lock);
+
+    // The staged payload now belongs to the ring, unless a compressed or shared one went there
+    // instead, then it is kept for the next command
+    if (entry.buffptr == file->pending) {
+        file->pending = NULL;
+        file->pending_capacity = 0;
+    }
+    file->pending_size = 0;
+    mutex_unlock(&file->lock);
+
+    // Neither the evicted payload nor a compressed copy that turned out to be shared belongs to anybody
+    kfree(payload);
+    if (unused) {
+        kfree(aesd_payload_of(unused));
+    }
+
+    trace_aesd_write(count, *f_pos, count, true);
+    aesd_latency_record(&dev->stats.write_latency, start_ns);
+
+    return count;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+    loff_t new_pos = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+
+    if (aesd_lock(dev)) {
+        return -ERESTARTSYS;
+    }
+
+    switch (whence) {
+        case SEEK_SET:
+            new_pos = off;
+            break;
+        case SEEK_CUR:
+            new_pos = filp->f_pos + off;
+            break;
+        case SEEK_END:
+            new_pos = dev->buffer.total_size + off;
+            break;
+        default:
+            mutex_unlock(&dev->lock);
+            trace_aesd_llseek(off, whence, -EINVAL);
+            return -EINVAL;
+    }
+
+    if (new_pos < 0 || new_pos > dev->buffer.total_size) {
+        mutex_unlock(&dev->lock);
+        trace_aesd_llseek(off, whence, -EINVAL);
+        return -EINVAL;
+    }
+
+    filp->f_pos = new_pos;
+    mutex_unlock(&dev->lock);
+    trace_aesd_llseek(off, whence, new_pos);
+    return new_pos;
+}
+
+/**
+ * Set the file position to byte write_cmd_offset of command write_cmd, counted from the oldest.
+ * Must be called with the device lock held.
+ */
+static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    loff_t new_pos = 0;
+
+    // Add up the sizes of the buffer entries until the write_cmd entry
+    aesd_circular_buffer_iter_init(&dev->buffer, &iter);
+    while ((entry = aesd_circular_buffer_iter_next(&dev->buffer, &iter)) != NULL && write_cmd > 0) {
+        new_pos += entry->size;
+        write_cmd--;
+    }
+
+    // The command must exist and hold the offset
+    if (!entry || write_cmd_offset >= entry->size) {
+        return -EINVAL;
+    }
+
+    filp->f_pos = new_pos + write_cmd_offset;
+
+    return 0;
+}
+
+/**
+ * Set the file position to the oldest command written at or after seektime->timestamp_ns,
+ * filling in the rest of seektime. Must be called with the device lock held.
+ */
+static void aesd_seek_time(struct file *filp, struct aesd_seektime *seektime)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    size_t char_offset;
+
+    entry = aesd_circular_buffer_iter_seek_time(&dev->buffer, &iter, seektime->timestamp_ns, &char_offset);
+    if (entry) {
+        seektime->found_timestamp_ns = entry->timestamp_ns;
+        seektime->seq = entry->seq;
+    } else {
+        seektime->found_timestamp_ns = 0;
+        seektime->seq = dev->buffer.next_seq;
+    }
+
+    filp->f_pos = char_offset;
+}
+
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekto seekto;
+    struct aesd_seektime seektime;
+    int retval = 0;
+
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
+
+    switch(cmd) {
+        case AESDCHAR_IOCSEEKTO:
+            if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto))) {
+                retval = -EFAULT;
+                break;
+            }
+            if (aesd_lock(dev)) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+
+            retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+            trace_aesd_seekto(seekto.write_cmd, seekto.write_cmd_offset, filp->f_pos, retval);
+            mutex_unlock(&dev->lock);
+            break;
+
+        case AESDCHAR_IOCSEEKTIME:
+            if (copy_from_user(&seektime, (const void __user *)arg, sizeof(seektime))) {
+                retval = -EFAULT;
+                break;
+            }
+            if (aesd_lock(dev)) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+
+            aesd_seek_time(filp, &seektime);
+            trace_aesd_seektime(seektime.timestamp_ns, seektime.seq, filp->f_pos);
+            mutex_unlock(&dev->lock);
+
+            if (copy_to_user((void __user *)arg, &seektime, sizeof(seektime))) {
+                retval = -EFAULT;
+            }
+            break;
+
+        default:
+            retval = -ENOTTY;
+            break;
+    }
+
+    return retval;
+}
@@ -0,0 +1,110 @@
+/*
+ * aesdchar-trace.h
+ *
+ * Tracepoints for the aesdchar driver. They cost a patched-out branch while
+ * disabled and can be turned on at runtime, for example with
+ *   echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_read,
+    TP_PROTO(size_t count, loff_t pos, ssize_t retval),
+    TP_ARGS(count, pos, retval),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, retval)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->retval = retval;
+    ),
+    TP_printk("count=%zu pos=%lld retval=%zd", __entry->count, __entry->pos, __entry->retval)
+);
+
+TRACE_EVENT(aesd_write,
+    TP_PROTO(size_t count, loff_t pos, ssize_t retval, bool committed),
+    TP_ARGS(count, pos, retval, committed),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, retval)
+        __field(bool, committed)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->retval = retval;
+        __entry->committed = committed;
+    ),
+    TP_printk("count=%zu pos=%lld retval=%zd committed=%d", __entry->count, __entry->pos,
+              __entry->retval, __entry->committed)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(loff_t off, int whence, loff_t retval),
+    TP_ARGS(off, whence, retval),
+    TP_STRUCT__entry(
+        __field(loff_t, off)
+        __field(int, whence)
+        __field(loff_t, retval)
+    ),
+    TP_fast_assign(
+        __entry->off = off;
+        __entry->whence = whence;
+        __entry->retval = retval;
+    ),
+    TP_printk("off=%lld whence=%d retval=%lld", __entry->off, __entry->whence, __entry->retval)
+);
+
+TRACE_EVENT(aesd_seekto,
+    TP_PROTO(u32 write_cmd, u32 write_cmd_offset, loff_t pos, long retval),
+    TP_ARGS(write_cmd, write_cmd_offset, pos, retval),
+    TP_STRUCT__entry(
+        __field(u32, write_cmd)
+        __field(u32, write_cmd_offset)
+        __field(loff_t, pos)
+        __field(long, retval)
+    ),
+    TP_fast_assign(
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->pos = pos;
+        __entry->retval = retval;
+    ),
+    TP_printk("write_cmd=%u write_cmd_offset=%u pos=%lld retval=%ld", __entry->write_cmd,
+              __entry->write_cmd_offset, __entry->pos, __entry->retval)
+);
+
+TRACE_EVENT(aesd_seektime,
+    TP_PROTO(u64 timestamp_ns, u64 seq, loff_t pos),
+    TP_ARGS(timestamp_ns, seq, pos),
+    TP_STRUCT__entry(
+        __field(u64, timestamp_ns)
+        __field(u64, seq)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->timestamp_ns = timestamp_ns;
+        __entry->seq = seq;
+        __entry->pos = pos;
+    ),
+    TP_printk("timestamp_ns=%llu seq=%llu pos=%lld", __entry->timestamp_ns, __entry->seq, __entry->pos)
+);
+
+#endif /* AESDCHAR_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar-trace
+#include <trace/define_trace.h>
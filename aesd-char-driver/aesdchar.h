@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
  
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
  
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -23,16 +23,100 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+// Userspace builds get the kernel types and helpers from the emulation shims
+#ifndef __KERNEL__
+#include "aesdchar-emu.h"
+#endif
+
+#define AESD_LATENCY_BUCKETS 32
+
+/**
+ * With AESDCHAR_COMPRESS defined (make COMPRESS=y) commands are stored LZ4
+ * compressed when that makes them smaller. Shorter ones are not worth it.
+ */
+#define AESDCHAR_COMPRESS_MIN_SIZE 64
+
+/**
+ * Latency histogram exposed in debugfs, bucket i counts the operations that
+ * completed in less than 2^i nanoseconds
+ */
+struct aesd_latency_hist
+{
+    atomic64_t buckets[AESD_LATENCY_BUCKETS];
+};
+
+/**
+ * Counters exposed in debugfs, updated without taking the device lock
+ */
+struct aesd_stats
+{
+    atomic64_t lock_contended;      /* Times the device lock was already held */
+    struct aesd_latency_hist read_latency;
+    struct aesd_latency_hist write_latency;
+};
+
+/**
+ * Contents of a command in the ring, entry buffptr pointing at data. Entries
+ * holding the same bytes share one payload, so a client repeating the same
+ * status line costs a single allocation however many copies the ring holds.
+ * refcount counts those entries and is protected by the device lock.
+ */
+struct aesd_payload
+{
+    u64 hash;
+    unsigned int refcount;
+    char data[];
+};
+
+static inline struct aesd_payload *aesd_payload_of(const char *data)
+{
+    return (struct aesd_payload *)(data - offsetof(struct aesd_payload, data));
+}
+
 struct aesd_dev
 {
-    /**
-     * TODO: Add structure(s) and locks needed to complete assignment requirements
-     */
-    struct aesd_buffer_entry *new_entry; /* Buffer entry */
     struct mutex lock;    /* Mutex to protect access to this structure */
     struct aesd_circular_buffer buffer; /* Buffer to store data */
     struct cdev cdev;     /* Char device structure      */
+    struct aesd_stats stats; /* Statistics exposed in debugfs */
+    struct dentry *debugfs;  /* debugfs directory of the device */
+};
+
+/**
+ * Per open file state, the private_data of each struct file. Writes that do
+ * not end in a newline are staged here, so only the write completing a
+ * command takes the device lock, and partial commands written through
+ * different files never get mixed.
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    struct mutex lock;          /* Serializes writes through this file */
+    char *pending;              /* Partial command, the data of a payload not yet in the ring */
+    size_t pending_size;
+    size_t pending_capacity;
+#ifdef AESDCHAR_COMPRESS
+    /*
+     * Compression output on write and decompressed entry on read, serialized by
+     * lock. On read it holds entry scratch_seq, so reading a compressed entry
+     * in small pieces only decompresses it once.
+     */
+    char *scratch;
+    size_t scratch_capacity;
+    u64 scratch_seq;
+    bool scratch_valid;
+    void *workmem;              /* LZ4_MEM_COMPRESS bytes, allocated on the first compression */
+#endif
 };
 
+/* aesdchar-fops.c */
+void aesd_dev_init(struct aesd_dev *dev);
+void aesd_dev_cleanup(struct aesd_dev *dev);
+int aesd_open(struct inode *inode, struct file *filp);
+int aesd_release(struct inode *inode, struct file *filp);
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence);
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,261 @@
+/**
+ * @file aesdchar-stress.c
+ * @brief Multi-threaded stress test of the aesdchar file operations in userspace
+ *
+ * Runs aesdchar-fops.c, built against aesdchar-emu.h, with writer threads
+ * appending newline terminated commands (optionally split into several partial
+ * writes) and reader threads rewinding and reading the whole device or seeking
+ * into it with AESDCHAR_IOCSEEKTO. Reports throughput per role, how often the
+ * device lock was contended and latency percentiles from the driver's own
+ * histograms.
+ *
+ * Usage: aesdchar-stress [-w writers] [-r readers] [-s command_size] [-c chunks] [-t seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#include "aesdchar.h"
+#include "bench-util.h"
+
+struct stress_options
+{
+    int writers;
+    int readers;
+    size_t command_size;
+    int chunks;
+    unsigned int seconds;
+};
+
+struct stress_thread
+{
+    pthread_t thread;
+    int id;
+    uint64_t operations;
+    uint64_t bytes;
+    uint64_t errors;
+};
+
+static struct aesd_dev device;
+static struct inode device_inode = { .i_cdev = &device.cdev };
+static struct stress_options options = {
+    .writers = 4,
+    .readers = 4,
+    .command_size = 64,
+    .chunks = 1,
+    .seconds = 2,
+};
+static atomic_int stop;
+
+static void *writer_main(void *arguments)
+{
+    struct stress_thread *self = arguments;
+    struct file filp = { 0 };
+    size_t chunk_size = options.command_size / options.chunks;
+    size_t offset, length;
+    ssize_t rc;
+    char *command;
+
+    command = malloc(options.command_size);
+    if (command == NULL) {
+        self->errors++;
+        return NULL;
+    }
+    memset(command, 'a' + self->id % 26, options.command_size - 1);
+    command[options.command_size - 1] = '\n';
+
+    aesd_open(&device_inode, &filp);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        for (offset = 0; offset < options.command_size; offset += length) {
+            length = options.command_size - offset;
+            if (length > chunk_size && offset + chunk_size < options.command_size) {
+                length = chunk_size;
+            }
+            rc = aesd_write(&filp, command + offset, length, &filp.f_pos);
+            if (rc != (ssize_t)length) {
+                self->errors++;
+                break;
+            }
+            self->bytes += length;
+        }
+        self->operations++;
+    }
+    aesd_release(&device_inode, &filp);
+
+    free(command);
+    return NULL;
+}
+
+static void *reader_main(void *arguments)
+{
+    struct stress_thread *self = arguments;
+    struct file filp = { 0 };
+    struct aesd_seekto seekto = { 0 };
+    uint64_t state = 0x9e3779b97f4a7c15ULL + self->id;
+    size_t buffer_size;
+    ssize_t rc;
+    char *buffer;
+
+    buffer_size = options.command_size;
+    buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+        self->errors++;
+        return NULL;
+    }
+
+    aesd_open(&device_inode, &filp);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // Every fourth pass starts from a random command instead of the beginning
+        if (bench_random(&state) % 4) {
+            rc = aesd_llseek(&filp, 0, SEEK_SET);
+        } else {
+            seekto.write_cmd = bench_random(&state) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            seekto.write_cmd_offset = 0;
+            rc = aesd_ioctl(&filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto);
+        }
+        // EINVAL is expected while the buffer is filling up
+        if (rc < 0 && rc != -EINVAL) {
+            self->errors++;
+        }
+
+        do {
+            rc = aesd_read(&filp, buffer, buffer_size, &filp.f_pos);
+            if (rc < 0) {
+                self->errors++;
+                break;
+            }
+            self->bytes += rc;
+        } while (rc > 0);
+        self->operations++;
+    }
+    aesd_release(&device_inode, &filp);
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * @return the upper bound in nanoseconds of the bucket holding the given percentile
+ */
+static unsigned long long latency_percentile(const struct aesd_latency_hist *hist, double percentile)
+{
+    long long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+        total += atomic64_read(&hist->buckets[i]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+        seen += atomic64_read(&hist->buckets[i]);
+        if (seen >= total * percentile) {
+            break;
+        }
+    }
+    return 1ULL << (i < AESD_LATENCY_BUCKETS ? i : AESD_LATENCY_BUCKETS - 1);
+}
+
+static void report(const char *role, struct stress_thread *threads, int count, double elapsed_s,
+                   const struct aesd_latency_hist *hist)
+{
+    uint64_t operations = 0, bytes = 0, errors = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        operations += threads[i].operations;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+    }
+
+    printf("%-8s %3d threads %12.0f ops/s %10.2f MB/s  p50 < %llu ns  p99 < %llu ns  %llu errors\n",
+           role, count, operations / elapsed_s, bytes / elapsed_s / 1e6,
+           latency_percentile(hist, 0.50), latency_percentile(hist, 0.99), (unsigned long long)errors);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-s command_size] [-c chunks] [-t seconds]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct stress_thread *threads;
+    uint64_t start, elapsed;
+    double elapsed_s;
+    int opt, i, total;
+
+    while ((opt = getopt(argc, argv, "w:r:s:c:t:")) != -1) {
+        switch (opt) {
+            case 'w':
+                options.writers = atoi(optarg);
+                break;
+            case 'r':
+                options.readers = atoi(optarg);
+                break;
+            case 's':
+                options.command_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.chunks = atoi(optarg);
+                break;
+            case 't':
+                options.seconds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (options.writers < 0 || options.readers < 0 || options.writers + options.readers == 0 ||
+        options.command_size == 0 || options.chunks < 1 || (size_t)options.chunks > options.command_size ||
+        options.seconds == 0) {
+        usage(argv[0]);
+    }
+
+    total = options.writers + options.readers;
+    threads = calloc(total, sizeof(*threads));
+    if (threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    aesd_dev_init(&device);
+
+    printf("capacity %d, %zu byte commands in %d chunks, %u s\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+           options.command_size, options.chunks, options.seconds);
+
+    start = bench_now_ns();
+    for (i = 0; i < total; i++) {
+        threads[i].id = i;
+        if (pthread_create(&threads[i].thread, NULL, i < options.writers ? writer_main : reader_main,
+                           &threads[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    sleep(options.seconds);
+    atomic_store(&stop, 1);
+
+    for (i = 0; i < total; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = bench_now_ns() - start;
+    elapsed_s = elapsed / 1e9;
+
+    report("write", threads, options.writers, elapsed_s, &device.stats.write_latency);
+    report("read", threads + options.writers, options.readers, elapsed_s, &device.stats.read_latency);
+    printf("lock contended %lld times\n", atomic64_read(&device.stats.lock_contended));
+
+    aesd_dev_cleanup(&device);
+    free(threads);
+
+    return 0;
+}
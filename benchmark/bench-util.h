@@ -0,0 +1,106 @@
+/**
+ * @file bench-util.h
+ * @brief Timing and hardware counter helpers shared by the userspace benchmarks
+ *
+ * Cache misses are read with perf_event_open when the kernel allows it
+ * (see /proc/sys/kernel/perf_event_paranoid), otherwise they are reported as n/a.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * Keep the compiler from optimizing away a computed value
+ */
+#define BENCH_KEEP(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @return a perf event fd counting cache misses of the calling thread, or -1 if unavailable
+ */
+static inline int bench_cache_misses_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void bench_counter_start(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/**
+ * @return the count since bench_counter_start(), or -1 if the counter is unavailable
+ */
+static inline int64_t bench_counter_stop(int fd)
+{
+    uint64_t count;
+
+    if (fd < 0) {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Print one result row, cache misses per operation or n/a
+ */
+static inline void bench_report(const char *name, const char *variant, uint64_t ops, uint64_t elapsed_ns,
+                                int64_t cache_misses)
+{
+    if (cache_misses >= 0) {
+        printf("%-24s %-12s %12.2f ns/op %10.4f misses/op\n", name, variant,
+               (double)elapsed_ns / ops, (double)cache_misses / ops);
+    } else {
+        printf("%-24s %-12s %12.2f ns/op %10s misses/op\n", name, variant,
+               (double)elapsed_ns / ops, "n/a");
+    }
+}
+
+/**
+ * xorshift64, fast and deterministic so runs are comparable
+ */
+static inline uint64_t bench_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+#endif /* BENCH_UTIL_H */
@@ -0,0 +1,219 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Userspace throughput benchmark for aesd-circular-buffer.c
+ *
+ * Measures aesd_circular_buffer_add_entry, aesd_circular_buffer_find_entry_offset_for_fpos,
+ * aesd_circular_buffer_get_next_entry and the iterator API for several entry size distributions.
+ * The buffer capacity is fixed at compile time by AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * and the layout by AESD_CIRCULAR_BUFFER_SOA, so CMake builds one executable per combination.
+ *
+ * Usage: circular-buffer-bench-<layout>-<capacity> [operations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aesd-circular-buffer.h"
+#include "bench-util.h"
+
+#define DEFAULT_OPERATIONS 2000000
+// Number of precomputed sizes and positions, a power of two so indexing is a mask
+#define TABLE_SIZE 4096
+#define MAX_ENTRY_SIZE 8192
+
+#ifdef AESD_CIRCULAR_BUFFER_SOA
+#define LAYOUT "soa"
+#else
+#define LAYOUT "aos"
+#endif
+
+struct size_distribution
+{
+    const char *name;
+    size_t (*next)(uint64_t *state);
+};
+
+static size_t size_fixed_small(uint64_t *state)
+{
+    (void)state;
+    return 16;
+}
+
+static size_t size_fixed_page(uint64_t *state)
+{
+    (void)state;
+    return 4096;
+}
+
+static size_t size_uniform(uint64_t *state)
+{
+    return 1 + bench_random(state) % 1024;
+}
+
+// Mostly short commands with occasional large ones
+static size_t size_bimodal(uint64_t *state)
+{
+    return (bench_random(state) % 10) ? 32 : MAX_ENTRY_SIZE;
+}
+
+static const struct size_distribution distributions[] = {
+    { "fixed-16", size_fixed_small },
+    { "fixed-4096", size_fixed_page },
+    { "uniform-1k", size_uniform },
+    { "bimodal", size_bimodal },
+};
+
+static char payload[MAX_ENTRY_SIZE];
+static size_t sizes[TABLE_SIZE];
+static size_t positions[TABLE_SIZE];
+
+static void fill_buffer(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        entry.size = sizes[i & (TABLE_SIZE - 1)];
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static void bench_add_entry(const char *variant, uint64_t operations, int perf_fd)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    uint64_t i, start, elapsed;
+    int64_t misses;
+
+    aesd_circular_buffer_init(&buffer);
+
+    bench_counter_start(perf_fd);
+    start = bench_now_ns();
+    for (i = 0; i < operations; i++) {
+        entry.size = sizes[i & (TABLE_SIZE - 1)];
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(perf_fd);
+
+    BENCH_KEEP(buffer.total_size);
+    bench_report("add_entry", variant, operations, elapsed, misses);
+}
+
+static void bench_find_entry(const char *variant, uint64_t operations, int perf_fd, uint64_t *state)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+    uint64_t i, start, elapsed;
+    int64_t misses;
+
+    fill_buffer(&buffer);
+    for (i = 0; i < TABLE_SIZE; i++) {
+        positions[i] = bench_random(state) % buffer.total_size;
+    }
+
+    bench_counter_start(perf_fd);
+    start = bench_now_ns();
+    for (i = 0; i < operations; i++) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[i & (TABLE_SIZE - 1)],
+                                                                &entry_offset);
+        BENCH_KEEP(entry);
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(perf_fd);
+
+    bench_report("find_entry_offset", variant, operations, elapsed, misses);
+}
+
+static void bench_get_next_entry(const char *variant, uint64_t operations, int perf_fd)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    uint64_t calls = 0, start, elapsed;
+    int64_t misses;
+
+    fill_buffer(&buffer);
+
+    // Walk the whole buffer from the oldest entry, as a full read of the device does
+    bench_counter_start(perf_fd);
+    start = bench_now_ns();
+    while (calls < operations) {
+        entry = NULL;
+        do {
+            entry = aesd_circular_buffer_get_next_entry(&buffer, entry);
+            calls++;
+        } while (entry != NULL);
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(perf_fd);
+
+    bench_report("get_next_entry", variant, calls, elapsed, misses);
+}
+
+static void bench_iter_next(const char *variant, uint64_t operations, int perf_fd)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    uint64_t calls = 0, start, elapsed;
+    int64_t misses;
+
+    fill_buffer(&buffer);
+
+    bench_counter_start(perf_fd);
+    start = bench_now_ns();
+    while (calls < operations) {
+        aesd_circular_buffer_iter_init(&buffer, &iter);
+        do {
+            entry = aesd_circular_buffer_iter_next(&buffer, &iter);
+            BENCH_KEEP(entry);
+            calls++;
+        } while (entry != NULL);
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(perf_fd);
+
+    bench_report("iter_next", variant, calls, elapsed, misses);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t operations = DEFAULT_OPERATIONS;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    const char *variant;
+    size_t d, i;
+    int perf_fd;
+
+    if (argc > 1) {
+        operations = strtoull(argv[1], NULL, 10);
+        if (operations == 0) {
+            fprintf(stderr, "Usage: %s [operations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    perf_fd = bench_cache_misses_open();
+
+    printf("capacity %d, layout " LAYOUT ", %llu operations per test%s\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+           (unsigned long long)operations, perf_fd < 0 ? ", cache misses unavailable" : "");
+
+    for (d = 0; d < sizeof(distributions) / sizeof(distributions[0]); d++) {
+        for (i = 0; i < TABLE_SIZE; i++) {
+            sizes[i] = distributions[d].next(&state);
+        }
+        variant = distributions[d].name;
+
+        bench_add_entry(variant, operations, perf_fd);
+        bench_find_entry(variant, operations, perf_fd, &state);
+        bench_get_next_entry(variant, operations, perf_fd);
+        bench_iter_next(variant, operations, perf_fd);
+    }
+
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+
+    return 0;
+}
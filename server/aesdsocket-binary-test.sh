@@ -0,0 +1,153 @@
+#!/bin/bash
+# Tester script for the binary protocol of aesdsocket, see aesdsocket-binary.h
+# Run against a server already listening, on localhost port 9000 by default:
+#   ./aesdsocket-binary-test.sh [host] [port]
+
+set -e
+set -u
+
+HOST=${1:-localhost}
+PORT=${2:-9000}
+# Seconds to wait for a response before giving up on the server
+TIMEOUT=5
+# BINARY_MAX_PAYLOAD
+MAX_PAYLOAD=$(( 16 * 1024 * 1024 ))
+
+OP_APPEND=1
+OP_SEEK=2
+OP_FETCH=3
+STATUS_OK=0
+STATUS_INVALID=1
+STATUS_UNSUPPORTED=2
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "${WORKDIR}"' EXIT
+
+fail() {
+	echo "failed: $1"
+	exit 1
+}
+
+# Print the 32-bit integer $1 in network byte order
+u32() {
+	printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(( ($1 >> 24) & 255 )) $(( ($1 >> 16) & 255 )) \
+		$(( ($1 >> 8) & 255 )) $(( $1 & 255 )))"
+}
+
+# Print a request header for opcode $1, request_id $2 and a payload of $3 bytes
+header() {
+	printf "$(printf '\\x%02x' "$1")\\x00\\x00\\x00"
+	u32 "$2"
+	u32 "$3"
+}
+
+# Print a whole request for opcode $1 and request_id $2, with the string $3 as payload
+request() {
+	local payload=${3:-}
+
+	header "$1" "$2" ${#payload}
+	printf '%s' "${payload}"
+}
+
+# Print a SEEK request with request_id $1 for write_cmd $2 and write_cmd_offset $3
+seek_request() {
+	header ${OP_SEEK} "$1" 8
+	u32 "$2"
+	u32 "$3"
+}
+
+connect() {
+	exec 3<>"/dev/tcp/${HOST}/${PORT}" || fail "could not connect to ${HOST}:${PORT}"
+	printf 'AESDSOCKET_MODE:BINARY\n' >&3
+}
+
+disconnect() {
+	exec 3>&-
+}
+
+# Read exactly $1 bytes from the server into the file $2
+receive() {
+	: > "$2"
+	if [ "$1" -gt 0 ]; then
+		timeout ${TIMEOUT} dd bs="$1" count=1 iflag=fullblock of="$2" <&3 2>/dev/null || true
+	fi
+	[ "$(wc -c < "$2")" -eq "$1" ]
+}
+
+# Read the next response, which must be for request_id $1 with status $2.
+# Its payload is left in ${WORKDIR}/payload.
+expect_response() {
+	local bytes
+
+	receive 12 "${WORKDIR}/header" || fail "no response to request $1"
+	bytes=($(od -An -v -tu1 "${WORKDIR}/header"))
+	local status=${bytes[1]}
+	local id=$(( (bytes[4] << 24) | (bytes[5] << 16) | (bytes[6] << 8) | bytes[7] ))
+	local length=$(( (bytes[8] << 24) | (bytes[9] << 16) | (bytes[10] << 8) | bytes[11] ))
+
+	[ "${id}" -eq "$1" ] || fail "expected the response to request $1 but got one to request ${id}"
+	[ "${status}" -eq "$2" ] || fail "expected status $2 for request $1 but got ${status}"
+	receive "${length}" "${WORKDIR}/payload" || fail "the response to request $1 was cut short"
+}
+
+# The payload of the last response must end with the string $1
+expect_payload_end() {
+	printf '%s' "$1" > "${WORKDIR}/expected"
+	tail -c "${#1}" "${WORKDIR}/payload" | cmp -s - "${WORKDIR}/expected" ||
+		fail "expected the reply to end with '$1' but got '$(tail -c "${#1}" "${WORKDIR}/payload")'"
+}
+
+echo "Testing the binary protocol of aesdsocket on ${HOST}:${PORT}"
+connect
+
+echo "A request split across several reads"
+request ${OP_APPEND} 1 "split request $$"$'\n' > "${WORKDIR}/split"
+head -c 5 "${WORKDIR}/split" >&3
+sleep 0.2
+tail -c +6 "${WORKDIR}/split" | head -c 10 >&3
+sleep 0.2
+tail -c +16 "${WORKDIR}/split" >&3
+expect_response 1 ${STATUS_OK}
+request ${OP_FETCH} 2 >&3
+expect_response 2 ${STATUS_OK}
+expect_payload_end "split request $$"$'\n'
+
+echo "Pipelined requests"
+{
+	request ${OP_APPEND} 3 "pipelined one $$"$'\n'
+	request ${OP_APPEND} 4 "pipelined two $$"$'\n'
+	request ${OP_FETCH} 5
+	request ${OP_APPEND} 6 "pipelined three $$"$'\n'
+	request ${OP_FETCH} 7
+} >&3
+expect_response 3 ${STATUS_OK}
+expect_response 4 ${STATUS_OK}
+expect_response 5 ${STATUS_OK}
+expect_payload_end "pipelined one $$"$'\n'"pipelined two $$"$'\n'
+expect_response 6 ${STATUS_OK}
+expect_response 7 ${STATUS_OK}
+expect_payload_end "pipelined two $$"$'\n'"pipelined three $$"$'\n'
+
+echo "An unknown opcode"
+{ request 9 8 "ignored"; request ${OP_FETCH} 9; } >&3
+expect_response 8 ${STATUS_UNSUPPORTED}
+expect_response 9 ${STATUS_OK}
+expect_payload_end "pipelined three $$"$'\n'
+
+echo "A SEEK out of range"
+{ seek_request 10 99999 0; request ${OP_FETCH} 11; } >&3
+expect_response 10 ${STATUS_INVALID}
+expect_response 11 ${STATUS_OK}
+expect_payload_end "pipelined three $$"$'\n'
+
+echo "A payload longer than BINARY_MAX_PAYLOAD"
+header ${OP_APPEND} 12 $(( MAX_PAYLOAD + 1 )) >&3
+if receive 1 "${WORKDIR}/closed"; then
+	fail "the server answered a request over BINARY_MAX_PAYLOAD"
+fi
+# Only a closed connection reads end of file before the timeout
+timeout ${TIMEOUT} cat <&3 > /dev/null || fail "the server kept the connection open after a request over BINARY_MAX_PAYLOAD"
+disconnect
+
+echo "success"
+exit 0
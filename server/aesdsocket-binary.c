@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesdsocket-binary.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+#include "aesdsocket-subscribe.h"
+
+void binary_init(binary_conn_t *conn) {
+    conn->in = NULL;
+    conn->in_size = 0;
+    conn->in_capacity = 0;
+    conn->out_size = 0;
+    memset(&conn->matches, 0, sizeof(conn->matches));
+}
+
+void binary_cleanup(binary_conn_t *conn) {
+    free(conn->in);
+    conn->in = NULL;
+    conn->in_size = 0;
+    conn->in_capacity = 0;
+    query_result_free(&conn->matches);
+}
+
+static ssize_t binary_send(int socket_fd, struct iovec *iov, int count) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    size_t total = 0;
+    ssize_t rc;
+
+    while (msg.msg_iovlen > 0) {
+        rc = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += rc;
+
+        // Skip over what was sent, which may end in the middle of a buffer
+        while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov->iov_len) {
+            rc -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+
+    METRICS_ADD(bytes_out, total);
+
+    return total;
+}
+
+static int binary_flush(binary_conn_t *conn, int socket_fd) {
+    struct iovec iov = { .iov_base = conn->out, .iov_len = conn->out_size };
+
+    if (conn->out_size == 0) {
+        return 0;
+    }
+    conn->out_size = 0;
+
+    return binary_send(socket_fd, &iov, 1) < 0 ? -1 : 0;
+}
+
+// Queue the header of a response carrying length bytes of payload, which the caller sends
+static int binary_respond(binary_conn_t *conn, int socket_fd, const binary_header_t *request,
+                          uint8_t status, size_t length) {
+    binary_header_t header = {
+        .opcode = request->opcode,
+        .status = status,
+        .reserved = 0,
+        .request_id = htonl(request->request_id),
+        .length = htonl(length),
+    };
+
+    if (conn->out_size + sizeof(header) > BINARY_OUT_SIZE && binary_flush(conn, socket_fd) < 0) {
+        return -1;
+    }
+    memcpy(conn->out + conn->out_size, &header, sizeof(header));
+    conn->out_size += sizeof(header);
+
+    return 0;
+}
+
+// Send the reply to a fetch right behind the responses queued so far, straight from the store snapshot
+static int binary_fetch(binary_conn_t *conn, store_handle_t *handle, int socket_fd, const binary_header_t *request) {
+    uint64_t start = metrics_now_ns();
+    struct iovec iov[2];
+    store_view_t view;
+    const char *data;
+    size_t length;
+    ssize_t sent;
+
+    if (store_reply_begin(handle, &view, &data, &length) < 0) {
+        AESD_LOG(LOG_ERR, "store_reply_begin: %m");
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_ERROR, 0);
+    }
+
+    if (length > UINT32_MAX) {
+        store_reply_end(handle, &view, -1);
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_ERROR, 0);
+    }
+
+    if (binary_respond(conn, socket_fd, request, BINARY_STATUS_OK, length) < 0) {
+        store_reply_end(handle, &view, -1);
+        return -1;
+    }
+
+    iov[0].iov_base = conn->out;
+    iov[0].iov_len = conn->out_size;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+    conn->out_size = 0;
+
+    sent = binary_send(socket_fd, iov, 2);
+    store_reply_end(handle, &view, sent);
+
+    METRICS_OBSERVE(store_read, metrics_now_ns() - start);
+
+    return sent < 0 ? -1 : 0;
+}
+
+// Send the commands matching a query right behind the responses queued so far
+static int binary_query(binary_conn_t *conn, int socket_fd, const binary_header_t *request, const char *payload) {
+    uint64_t start = metrics_now_ns();
+    query_result_t *result = &conn->matches;
+    store_view_t view;
+    query_t query;
+    ssize_t sent;
+
+    if (request->length < 2 * sizeof(uint32_t)) {
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_INVALID, 0);
+    }
+    memcpy(&query.first, payload, sizeof(uint32_t));
+    memcpy(&query.last, payload + sizeof(uint32_t), sizeof(uint32_t));
+    query.first = ntohl(query.first);
+    query.last = ntohl(query.last);
+    query.pattern = payload + 2 * sizeof(uint32_t);
+    query.pattern_length = request->length - 2 * sizeof(uint32_t);
+    if (query.last < query.first) {
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_INVALID, 0);
+    }
+
+    if (store_acquire_view(&view) < 0) {
+        AESD_LOG(LOG_ERR, "store_acquire_view: %m");
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_ERROR, 0);
+    }
+
+    if (query_match(&query, view.data, view.size, result) < 0 || result->length > UINT32_MAX) {
+        store_release_view(&view);
+        return binary_respond(conn, socket_fd, request, BINARY_STATUS_ERROR, 0);
+    }
+
+    if (binary_respond(conn, socket_fd, request, BINARY_STATUS_OK, result->length) < 0) {
+        store_release_view(&view);
+        return -1;
+    }
+
+    result->iov[0].iov_base = conn->out;
+    result->iov[0].iov_len = conn->out_size;
+    conn->out_size = 0;
+
+    sent = query_send(socket_fd, result);
+    if (sent > 0) {
+        METRICS_ADD(bytes_out, sent);
+    }
+    store_release_view(&view);
+
+    METRICS_OBSERVE(store_query, metrics_now_ns() - start);
+
+    return sent < 0 ? -1 : 0;
+}
+
+static int binary_handle(binary_conn_t *conn, store_handle_t *handle, int socket_fd,
+                         const binary_header_t *request, const char *payload) {
+    struct aesd_seekto seekto;
+    uint8_t status = BINARY_STATUS_OK;
+
+    switch (request->opcode) {
+        case BINARY_OP_APPEND:
+            if (store_append(handle, payload, request->length) < 0) {
+                AESD_LOG(LOG_ERR, "store_append: %m");
+                status = BINARY_STATUS_ERROR;
+            }
+            subscribe_notify();
+            break;
+        case BINARY_OP_SEEK:
+            if (request->length != 2 * sizeof(uint32_t)) {
+                status = BINARY_STATUS_INVALID;
+                break;
+            }
+            memcpy(&seekto.write_cmd, payload, sizeof(uint32_t));
+            memcpy(&seekto.write_cmd_offset, payload + sizeof(uint32_t), sizeof(uint32_t));
+            seekto.write_cmd = ntohl(seekto.write_cmd);
+            seekto.write_cmd_offset = ntohl(seekto.write_cmd_offset);
+            if (store_seekto(handle, &seekto) == -1) {
+                AESD_LOG(LOG_WARNING, "ioctl: %m");
+                status = BINARY_STATUS_INVALID;
+            }
+            break;
+        case BINARY_OP_FETCH:
+            return binary_fetch(conn, handle, socket_fd, request);
+        case BINARY_OP_QUERY:
+            return binary_query(conn, socket_fd, request, payload);
+        case BINARY_OP_MODE:
+            if (request->length != 1) {
+                status = BINARY_STATUS_INVALID;
+                break;
+            }
+            store_set_delta(handle, payload[0] != 0);
+            break;
+        default:
+            status = BINARY_STATUS_UNSUPPORTED;
+            break;
+    }
+
+    return binary_respond(conn, socket_fd, request, status, 0);
+}
+
+static int binary_in_append(binary_conn_t *conn, const char *data, size_t length) {
+    size_t capacity = conn->in_capacity ? conn->in_capacity : BINARY_OUT_SIZE;
+    char *in;
+
+    if (conn->in_size + length > conn->in_capacity) {
+        while (capacity < conn->in_size + length) {
+            capacity *= 2;
+        }
+        in = realloc(conn->in, capacity);
+        if (in == NULL) {
+            return -1;
+        }
+        conn->in = in;
+        conn->in_capacity = capacity;
+    }
+
+    memcpy(conn->in + conn->in_size, data, length);
+    conn->in_size += length;
+
+    return 0;
+}
+
+/**
+ * Handle the complete requests in what was just read from the connection,
+ * keeping any incomplete one for the next call.
+ * @return -1 when the connection should be closed, on a send error or a request
+ * too long to be trusted
+ */
+int binary_receive(binary_conn_t *conn, store_handle_t *handle, int socket_fd, const char *data, size_t length) {
+    binary_header_t header;
+    const char *p = data;
+    size_t available = length;
+    size_t frame;
+    int retval = 0;
+
+    // Complete a request left over from the previous read first
+    if (conn->in_size) {
+        if (binary_in_append(conn, data, length) < 0) {
+            return -1;
+        }
+        p = conn->in;
+        available = conn->in_size;
+    }
+
+    while (available >= sizeof(header)) {
+        memcpy(&header, p, sizeof(header));
+        header.request_id = ntohl(header.request_id);
+        header.length = ntohl(header.length);
+
+        if (header.length > BINARY_MAX_PAYLOAD) {
+            AESD_LOG(LOG_WARNING, "Binary request of %u bytes, closing", header.length);
+            errno = EMSGSIZE;
+            retval = -1;
+            break;
+        }
+
+        frame = sizeof(header) + header.length;
+        if (available < frame) {
+            break;
+        }
+
+        if (binary_handle(conn, handle, socket_fd, &header, p + sizeof(header)) < 0) {
+            retval = -1;
+            break;
+        }
+        p += frame;
+        available -= frame;
+    }
+
+    if (retval == 0 && binary_flush(conn, socket_fd) < 0) {
+        retval = -1;
+    }
+
+    // Keep the start of the next request
+    if (conn->in_size) {
+        memmove(conn->in, p, available);
+        conn->in_size = available;
+    } else if (available && binary_in_append(conn, p, available) < 0) {
+        retval = -1;
+    }
+
+    return retval;
+}
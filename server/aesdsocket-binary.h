@@ -0,0 +1,71 @@
+#ifndef AESDSOCKET_BINARY_H
+#define AESDSOCKET_BINARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesdsocket-store.h"
+#include "aesdsocket-query.h"
+
+/**
+ * Header of every request and response once a connection has switched to the
+ * binary protocol with CMD_MODE_BINARY, followed by length bytes of payload.
+ * Integers are in network byte order. Requests are handled in the order they
+ * arrive, so a client can send several without waiting and match up the
+ * responses by request_id.
+ */
+typedef struct {
+    uint8_t opcode;
+    uint8_t status;       // Responses only, 0 in requests
+    uint16_t reserved;
+    uint32_t request_id;  // Chosen by the client, echoed in the response
+    uint32_t length;
+} binary_header_t;
+
+enum {
+    // Append the payload to the store as it is, newlines included. Empty response.
+    BINARY_OP_APPEND = 1,
+    // Payload write_cmd and write_cmd_offset as two 32-bit integers, like AESDCHAR_IOCSEEKTO. Empty response.
+    BINARY_OP_SEEK,
+    // No payload, the response carries what a text mode reply would
+    BINARY_OP_FETCH,
+    // Payload one byte, 1 for delta replies and 0 for full ones. Empty response.
+    BINARY_OP_MODE,
+    /**
+     * Payload the first and last command to search as two 32-bit integers, QUERY_LAST
+     * for the newest, followed by the pattern. The response carries the matching
+     * commands, see CMD_QUERY.
+     */
+    BINARY_OP_QUERY,
+};
+
+enum {
+    BINARY_STATUS_OK,
+    BINARY_STATUS_INVALID,      // Malformed payload, a seek past the stored commands or an empty query range
+    BINARY_STATUS_UNSUPPORTED,  // Unknown opcode
+    BINARY_STATUS_ERROR,        // The store failed
+};
+
+// Largest request payload, a longer one ends the connection as its framing can no longer be trusted
+#define BINARY_MAX_PAYLOAD (16 * 1024 * 1024)
+// Responses are gathered here and sent together once all requests received so far are handled
+#define BINARY_OUT_SIZE 4096
+
+/**
+ * Binary protocol state of a connection. Requests are handled straight from
+ * the read buffer, only one cut off by the end of a read is copied into in.
+ */
+typedef struct {
+    char *in;
+    size_t in_size;
+    size_t in_capacity;
+    char out[BINARY_OUT_SIZE];
+    size_t out_size;
+    query_result_t matches;  // Reused by every query on the connection
+} binary_conn_t;
+
+void binary_init(binary_conn_t *conn);
+void binary_cleanup(binary_conn_t *conn);
+int binary_receive(binary_conn_t *conn, store_handle_t *handle, int socket_fd, const char *data, size_t length);
+
+#endif
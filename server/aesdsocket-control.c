@@ -0,0 +1,258 @@
+// For accept4
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "aesdsocket-control.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+
+static void control_address(struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strncpy(address->sun_path, CONTROL_SOCKET_PATH, sizeof(address->sun_path) - 1);
+}
+
+int control_socket_create(void) {
+    struct sockaddr_un address;
+    int control_fd;
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_fd < 0) {
+        return -1;
+    }
+
+    // Only a path left by an instance that did not exit cleanly is removed, never a running one's
+    control_address(&address);
+    if (aesdsocket_remove_stale_socket(&address) < 0) {
+        close(control_fd);
+        return -1;
+    }
+
+    if (bind(control_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(control_fd, 1) < 0) {
+        close(control_fd);
+        return -1;
+    }
+
+    return control_fd;
+}
+
+void control_socket_close(int control_fd) {
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(CONTROL_SOCKET_PATH);
+    }
+}
+
+// Send the listening sockets that are open to the new instance along with an acknowledgement
+static int control_send_fds(int connection_fd, const int *server_fds, int count) {
+    char ack[] = "OK\n";
+    char control[CMSG_SPACE(CONTROL_MAX_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = ack, .iov_len = sizeof(ack) - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[CONTROL_MAX_FDS];
+    int i, sent = 0;
+
+    for (i = 0; i < count && sent < CONTROL_MAX_FDS; i++) {
+        if (server_fds[i] >= 0) {
+            fds[sent++] = server_fds[i];
+        }
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sent * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sent * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, sent * sizeof(int));
+
+    return sendmsg(connection_fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Accept a client on the control socket. Its socket is non-blocking and the
+ * event loop reads its command as it arrives, so a slow or silent client never
+ * stalls the loop, it is only dropped once CONTROL_TIMEOUT_MS have passed.
+ * @return -1 if no client could be accepted
+ */
+int control_accept(int control_fd, control_client_t *client) {
+    client->fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client->fd < 0) {
+        return -1;
+    }
+
+    client->deadline_ns = metrics_now_ns() + CONTROL_TIMEOUT_MS * 1000000ULL;
+    client->length = 0;
+
+    return 0;
+}
+
+void control_client_close(control_client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+// Drop the client if it has not sent a whole command by its deadline
+void control_client_expire(control_client_t *client, uint64_t now_ns) {
+    if (client->fd >= 0 && now_ns >= client->deadline_ns) {
+        AESD_LOG(LOG_WARNING, "Control client timed out");
+        control_client_close(client);
+    }
+}
+
+/**
+ * Read what the client has sent so far and run its command once it is complete.
+ * On a handoff request the listening sockets are passed to the client, the
+ * control connection is left open in handoff_fd and CONTROL_HANDOFF is
+ * returned. The caller then drains, exits, and the new instance sees the
+ * connection close once this instance is gone.
+ * @return CONTROL_PENDING while the command is still incomplete
+ */
+int control_handle_client(control_client_t *client, const int *server_fds, int count, int *handoff_fd) {
+    char *buffer = client->buffer;
+    ssize_t valread;
+    int level;
+
+    valread = read(client->fd, buffer + client->length, sizeof(client->buffer) - 1 - client->length);
+    if (valread < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return CONTROL_PENDING;
+    }
+    if (valread <= 0) {
+        control_client_close(client);
+        return CONTROL_NONE;
+    }
+    client->length += valread;
+    buffer[client->length] = '\0';
+
+    // Commands are a single line, run what arrived once the buffer is full
+    if (strpbrk(buffer, "\r\n") == NULL && client->length < sizeof(client->buffer) - 1) {
+        return CONTROL_PENDING;
+    }
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+
+    if (strcmp(buffer, CONTROL_CMD_HANDOFF) == 0) {
+        if (control_send_fds(client->fd, server_fds, count) < 0) {
+            AESD_LOG(LOG_ERR, "sendmsg: %m");
+            control_client_close(client);
+            return CONTROL_NONE;
+        }
+
+        AESD_LOG(LOG_INFO, "Handed off listening sockets to new instance");
+        *handoff_fd = client->fd;
+        client->fd = -1;
+        return CONTROL_HANDOFF;
+    }
+
+    if (strncmp(buffer, CONTROL_CMD_LOGLEVEL " ", sizeof(CONTROL_CMD_LOGLEVEL)) == 0) {
+        level = log_parse_level(buffer + sizeof(CONTROL_CMD_LOGLEVEL));
+        if (level >= 0) {
+            log_set_level(level);
+            AESD_LOG(LOG_NOTICE, "Log level set to %d", level);
+            write(client->fd, "OK\n", 3);
+            control_client_close(client);
+            return CONTROL_NONE;
+        }
+    }
+
+    write(client->fd, "ERROR\n", 6);
+    control_client_close(client);
+
+    return CONTROL_NONE;
+}
+
+/**
+ * Ask the running instance for its listening sockets, storing up to max of them in server_fds.
+ * @return the number of listening sockets, or -1 if no instance handed any over.
+ * On success handoff_fd holds the control connection to pass to control_wait_handoff()
+ */
+int control_request_handoff(int *server_fds, int max, int *handoff_fd) {
+    struct sockaddr_un address;
+    char ack[CONTROL_BUFFER_SIZE];
+    char control[CMSG_SPACE(CONTROL_MAX_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = ack, .iov_len = sizeof(ack) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[CONTROL_MAX_FDS];
+    int connection_fd, i, count = 0;
+
+    connection_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection_fd < 0) {
+        return -1;
+    }
+
+    control_address(&address);
+    if (connect(connection_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(connection_fd);
+        return -1;
+    }
+
+    if (write(connection_fd, CONTROL_CMD_HANDOFF "\n", sizeof(CONTROL_CMD_HANDOFF)) < 0) {
+        close(connection_fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(connection_fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        close(connection_fd);
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+
+    if (count == 0) {
+        close(connection_fd);
+        return -1;
+    }
+
+    // Close any that do not fit, e.g. from a newer instance listening on more sockets
+    for (i = 0; i < count; i++) {
+        if (i < max) {
+            server_fds[i] = fds[i];
+        } else {
+            close(fds[i]);
+        }
+    }
+
+    *handoff_fd = connection_fd;
+
+    return count < max ? count : max;
+}
+
+// Block until the previous instance has drained its connections and exited
+void control_wait_handoff(int handoff_fd) {
+    char buffer[CONTROL_BUFFER_SIZE];
+    ssize_t rc;
+
+    while ((rc = read(handoff_fd, buffer, sizeof(buffer))) != 0) {
+        if (rc < 0 && errno != EINTR) {
+            break;
+        }
+    }
+
+    close(handoff_fd);
+}
@@ -0,0 +1,43 @@
+#ifndef AESDSOCKET_CONTROL_H
+#define AESDSOCKET_CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Unix socket used by a newly started instance to take over from the running one
+#define CONTROL_SOCKET_PATH "/var/tmp/aesdsocket.sock"
+#define CONTROL_BUFFER_SIZE 128
+// Time a control client gets to send its command before it is dropped
+#define CONTROL_TIMEOUT_MS 1000
+// Most listening sockets handed over at once
+#define CONTROL_MAX_FDS 8
+
+#define CONTROL_CMD_HANDOFF "HANDOFF"
+// Followed by a syslog level name or number, e.g. "LOGLEVEL debug"
+#define CONTROL_CMD_LOGLEVEL "LOGLEVEL"
+
+enum {
+    CONTROL_NONE,
+    CONTROL_HANDOFF,
+    CONTROL_PENDING,
+};
+
+// The control client being served by the event loop, only one at a time
+typedef struct {
+    int fd;                // -1 while no client is connected
+    uint64_t deadline_ns;  // CLOCK_MONOTONIC time the client is dropped at
+    size_t length;
+    char buffer[CONTROL_BUFFER_SIZE];
+} control_client_t;
+
+int control_socket_create(void);
+void control_socket_close(int control_fd);
+int control_accept(int control_fd, control_client_t *client);
+void control_client_close(control_client_t *client);
+void control_client_expire(control_client_t *client, uint64_t now_ns);
+int control_handle_client(control_client_t *client, const int *server_fds, int count, int *handoff_fd);
+
+int control_request_handoff(int *server_fds, int max, int *handoff_fd);
+void control_wait_handoff(int handoff_fd);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "aesdsocket-limit.h"
+#include "aesdsocket-metrics.h"
+
+static LIST_HEAD(limit_host_head_s, limit_host) limit_hosts[LIMIT_HOST_BUCKETS];
+static pthread_mutex_t limit_hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long limit_host_packet_rate;
+static unsigned long limit_host_byte_rate;
+
+static void limit_bucket_init(limit_bucket_t *bucket, unsigned long rate, uint64_t now) {
+    bucket->rate = rate;
+    bucket->tokens = rate;
+    bucket->refill_ns = now;
+}
+
+// Take amount tokens, returning how long to wait until the bucket is out of debt
+static uint64_t limit_bucket_take(limit_bucket_t *bucket, size_t amount, uint64_t now) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+
+    bucket->tokens += (now - bucket->refill_ns) * (double)bucket->rate / 1e9;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+    bucket->refill_ns = now;
+
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0) {
+        return 0;
+    }
+
+    return -bucket->tokens * 1e9 / bucket->rate;
+}
+
+void limit_init(limit_t *limit, unsigned long packet_rate, unsigned long byte_rate) {
+    uint64_t now = metrics_now_ns();
+
+    limit_bucket_init(&limit->packets, packet_rate, now);
+    limit_bucket_init(&limit->bytes, byte_rate, now);
+}
+
+// Account one packet of the given size, returning how long to wait before handling it
+uint64_t limit_take(limit_t *limit, size_t bytes) {
+    uint64_t now = metrics_now_ns();
+    uint64_t packets_delay, bytes_delay;
+
+    packets_delay = limit_bucket_take(&limit->packets, 1, now);
+    bytes_delay = limit_bucket_take(&limit->bytes, bytes, now);
+
+    return packets_delay > bytes_delay ? packets_delay : bytes_delay;
+}
+
+/**
+ * Sleep for the given time, or until the socket is shut down so a throttled
+ * connection does not hold up draining on exit
+ */
+void limit_wait(int socket_fd, uint64_t delay_ns) {
+    // Asking for no events still reports a hang up
+    struct pollfd fd = { .fd = socket_fd, .events = 0 };
+
+    poll(&fd, 1, (delay_ns + 999999) / 1000000);
+}
+
+// Per source address limits, 0 for none. Must be set before the first connection is accepted.
+void limit_hosts_configure(unsigned long packet_rate, unsigned long byte_rate) {
+    limit_host_packet_rate = packet_rate;
+    limit_host_byte_rate = byte_rate;
+}
+
+static unsigned int limit_host_hash(const unsigned char *address) {
+    uint32_t hash = 2166136261u;
+    int i;
+
+    // FNV-1a
+    for (i = 0; i < 16; i++) {
+        hash = (hash ^ address[i]) * 16777619u;
+    }
+
+    return hash % LIMIT_HOST_BUCKETS;
+}
+
+/**
+ * @return the limits shared with the other connections from the same source address,
+ * or NULL when there are no per address limits or the address is not an IP address.
+ * Each reference must be returned with limit_host_put().
+ */
+limit_host_t *limit_host_get(const struct sockaddr *address) {
+    unsigned char key[16];
+    limit_host_t *host;
+    unsigned int hash;
+
+    if (limit_host_packet_rate == 0 && limit_host_byte_rate == 0) {
+        return NULL;
+    }
+
+    if (address->sa_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)address)->sin_addr, 4);
+    } else if (address->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)address)->sin6_addr, 16);
+    } else {
+        return NULL;
+    }
+    hash = limit_host_hash(key);
+
+    pthread_mutex_lock(&limit_hosts_lock);
+
+    LIST_FOREACH(host, &limit_hosts[hash], entries) {
+        if (memcmp(host->address, key, sizeof(key)) == 0) {
+            host->refcount++;
+            pthread_mutex_unlock(&limit_hosts_lock);
+            return host;
+        }
+    }
+
+    host = malloc(sizeof(limit_host_t));
+    if (host != NULL) {
+        memcpy(host->address, key, sizeof(key));
+        host->refcount = 1;
+        limit_init(&host->limit, limit_host_packet_rate, limit_host_byte_rate);
+        LIST_INSERT_HEAD(&limit_hosts[hash], host, entries);
+    }
+
+    pthread_mutex_unlock(&limit_hosts_lock);
+
+    return host;
+}
+
+void limit_host_put(limit_host_t *host) {
+    if (host == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&limit_hosts_lock);
+    if (--host->refcount == 0) {
+        LIST_REMOVE(host, entries);
+        free(host);
+    }
+    pthread_mutex_unlock(&limit_hosts_lock);
+}
+
+// limit_take() for the limits shared by a source address
+uint64_t limit_host_take(limit_host_t *host, size_t bytes) {
+    uint64_t delay;
+
+    pthread_mutex_lock(&limit_hosts_lock);
+    delay = limit_take(&host->limit, bytes);
+    pthread_mutex_unlock(&limit_hosts_lock);
+
+    return delay;
+}
@@ -0,0 +1,49 @@
+#ifndef AESDSOCKET_LIMIT_H
+#define AESDSOCKET_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+// Hash chains in the table of per source address limits
+#define LIMIT_HOST_BUCKETS 256
+
+/**
+ * Token bucket refilled at rate tokens per second, holding at most one second
+ * worth of them. The count may go below zero, so a packet larger than the
+ * bucket is let through and paid off over the following time.
+ */
+typedef struct {
+    unsigned long rate;  // 0 for no limit
+    double tokens;
+    uint64_t refill_ns;
+} limit_bucket_t;
+
+// Packets and bytes per second, limited together
+typedef struct {
+    limit_bucket_t packets;
+    limit_bucket_t bytes;
+} limit_t;
+
+/**
+ * Limits shared by all connections from one source address, kept while any
+ * of them is open. IPv4 addresses are stored IPv4-mapped.
+ */
+typedef struct limit_host {
+    unsigned char address[16];
+    int refcount;
+    limit_t limit;
+    LIST_ENTRY(limit_host) entries;
+} limit_host_t;
+
+void limit_init(limit_t *limit, unsigned long packet_rate, unsigned long byte_rate);
+uint64_t limit_take(limit_t *limit, size_t bytes);
+void limit_wait(int socket_fd, uint64_t delay_ns);
+
+void limit_hosts_configure(unsigned long packet_rate, unsigned long byte_rate);
+limit_host_t *limit_host_get(const struct sockaddr *address);
+void limit_host_put(limit_host_t *host);
+uint64_t limit_host_take(limit_host_t *host, size_t bytes);
+
+#endif
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "aesdsocket-log.h"
+
+/**
+ * A single producer, single consumer ring of log records. The owning thread
+ * advances head and the log thread advances tail, each on its own cache line.
+ * The rate limit state is only touched by the owning thread.
+ */
+typedef struct log_ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_int closed;
+    double tokens;
+    uint64_t refill_ns;
+    unsigned long suppressed;
+    TAILQ_ENTRY(log_ring) entries;
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+atomic_int log_level = LOG_INFO;
+
+static __thread log_ring_t *log_local;
+// Rings created since the last drain, log_lock only guards this list and log_stop
+static TAILQ_HEAD(log_head_s, log_ring) log_head = TAILQ_HEAD_INITIALIZER(log_head);
+// Rings already taken over by the log thread, which alone walks and frees them
+static struct log_head_s log_drained = TAILQ_HEAD_INITIALIZER(log_drained);
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log_thread;
+static atomic_int log_running;
+static int log_stop;
+static int log_to_stdout;
+
+static const char *log_level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+static uint64_t log_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static log_ring_t *log_ring_create(void) {
+    log_ring_t *ring;
+
+    ring = aligned_alloc(_Alignof(log_ring_t), sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    ring->tokens = LOG_RATE_LIMIT;
+    ring->refill_ns = log_now_ns();
+    ring->suppressed = 0;
+
+    pthread_mutex_lock(&log_lock);
+    TAILQ_INSERT_TAIL(&log_head, ring, entries);
+    pthread_mutex_unlock(&log_lock);
+
+    return ring;
+}
+
+// Reserve the next record of the ring, or NULL when the log thread has fallen behind
+static log_record_t *log_ring_next(log_ring_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == LOG_RING_SIZE) {
+        return NULL;
+    }
+
+    return &ring->records[head & (LOG_RING_SIZE - 1)];
+}
+
+static void log_ring_push(log_ring_t *ring) {
+    atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// Token bucket refilled at LOG_RATE_LIMIT messages per second
+static int log_rate_allow(log_ring_t *ring) {
+    uint64_t now = log_now_ns();
+
+    ring->tokens += (now - ring->refill_ns) * (double)LOG_RATE_LIMIT / 1e9;
+    if (ring->tokens > LOG_RATE_LIMIT) {
+        ring->tokens = LOG_RATE_LIMIT;
+    }
+    ring->refill_ns = now;
+
+    if (ring->tokens < 1) {
+        return 0;
+    }
+
+    ring->tokens -= 1;
+    return 1;
+}
+
+void log_message(int level, const char *format, ...) {
+    log_ring_t *ring;
+    log_record_t *record;
+    va_list args;
+
+    // Before the log thread is running (or after it stopped) log synchronously
+    if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+        va_start(args, format);
+        vsyslog(level, format, args);
+        va_end(args);
+        if (log_to_stdout) {
+            va_start(args, format);
+            vprintf(format, args);
+            va_end(args);
+            printf("\n");
+        }
+        return;
+    }
+
+    ring = log_local;
+    if (ring == NULL) {
+        ring = log_local = log_ring_create();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    if (!log_rate_allow(ring)) {
+        ring->suppressed++;
+        return;
+    }
+
+    // Report messages dropped by the rate limit or a full ring before this one
+    if (ring->suppressed) {
+        record = log_ring_next(ring);
+        if (record == NULL) {
+            ring->suppressed++;
+            return;
+        }
+        record->level = LOG_WARNING;
+        snprintf(record->message, sizeof(record->message), "%lu log messages suppressed", ring->suppressed);
+        log_ring_push(ring);
+        ring->suppressed = 0;
+    }
+
+    record = log_ring_next(ring);
+    if (record == NULL) {
+        ring->suppressed++;
+        return;
+    }
+
+    record->level = level;
+    va_start(args, format);
+    vsnprintf(record->message, sizeof(record->message), format, args);
+    va_end(args);
+    log_ring_push(ring);
+}
+
+/**
+ * Write out everything queued in the rings. Only called from the log thread and
+ * without log_lock held, so threads creating their rings never wait on syslog.
+ */
+static void log_drain(int final) {
+    log_ring_t *ring, *next;
+    log_record_t *record;
+    size_t head, tail;
+    int closed;
+
+    // Take over the rings created since the last drain
+    pthread_mutex_lock(&log_lock);
+    TAILQ_CONCAT(&log_drained, &log_head, entries);
+    pthread_mutex_unlock(&log_lock);
+
+    ring = TAILQ_FIRST(&log_drained);
+    while (ring != NULL) {
+        next = TAILQ_NEXT(ring, entries);
+
+        // Read closed before head, so a closed ring is only freed once its last record is out
+        closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head) {
+            record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            syslog(record->level, "%s", record->message);
+            if (log_to_stdout) {
+                printf("%s\n", record->message);
+            }
+            tail++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (closed || final) {
+            TAILQ_REMOVE(&log_drained, ring, entries);
+            free(ring);
+        }
+
+        ring = next;
+    }
+
+    if (log_to_stdout) {
+        fflush(stdout);
+    }
+}
+
+static void *log_thread_main(void *arguments) {
+    struct timespec deadline;
+
+    (void)arguments;
+
+    pthread_mutex_lock(&log_lock);
+    while (!log_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+
+        pthread_mutex_unlock(&log_lock);
+        log_drain(0);
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    log_drain(1);
+
+    return NULL;
+}
+
+/**
+ * Start the background log thread. Must be called after daemon(), since the
+ * thread would not survive the fork.
+ */
+int log_init(int to_stdout) {
+    int rc;
+
+    log_to_stdout = to_stdout;
+    log_stop = 0;
+
+    rc = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    atomic_store_explicit(&log_running, 1, memory_order_release);
+
+    return 0;
+}
+
+// Flush all queued messages and stop the log thread, later messages are logged synchronously
+void log_shutdown(void) {
+    if (!atomic_load(&log_running)) {
+        return;
+    }
+
+    atomic_store_explicit(&log_running, 0, memory_order_release);
+
+    pthread_mutex_lock(&log_lock);
+    log_stop = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_join(log_thread, NULL);
+    log_local = NULL;
+}
+
+// Hand the calling thread's ring over to the log thread to be drained and freed
+void log_thread_exit(void) {
+    if (log_local) {
+        atomic_store_explicit(&log_local->closed, 1, memory_order_release);
+        log_local = NULL;
+    }
+}
+
+// Accept a syslog level name such as "debug", or its number
+int log_parse_level(const char *name) {
+    char *end;
+    long level;
+    size_t i;
+
+    for (i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); i++) {
+        if (strcasecmp(name, log_level_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    level = strtol(name, &end, 10);
+    if (*name == '\0' || *end != '\0' || level < LOG_EMERG || level > LOG_DEBUG) {
+        return -1;
+    }
+
+    return level;
+}
+
+void log_set_level(int level) {
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
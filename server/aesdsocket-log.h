@@ -0,0 +1,38 @@
+#ifndef AESDSOCKET_LOG_H
+#define AESDSOCKET_LOG_H
+
+#include <stdatomic.h>
+#include <syslog.h>
+
+// Records per thread ring, must be a power of two
+#define LOG_RING_SIZE 256
+#define LOG_MESSAGE_SIZE 240
+// How often the background thread drains the rings
+#define LOG_FLUSH_INTERVAL_MS 100
+// Each thread may log this many messages per second, with bursts of the same size
+#define LOG_RATE_LIMIT 100
+
+typedef struct {
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+extern atomic_int log_level;
+
+// Check the level before paying for any formatting
+#define AESD_LOG(level, ...) \
+    do { \
+        if ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+            log_message((level), __VA_ARGS__); \
+    } while (0)
+
+int log_init(int to_stdout);
+void log_shutdown(void);
+void log_thread_exit(void);
+
+void log_message(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+int log_parse_level(const char *name);
+void log_set_level(int level);
+
+#endif
@@ -0,0 +1,271 @@
+// For accept4 and open_memstream
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "aesdsocket-metrics.h"
+
+__thread metrics_counters_t *metrics_local;
+
+static TAILQ_HEAD(metrics_head_s, metrics_counters) metrics_head = TAILQ_HEAD_INITIALIZER(metrics_head);
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+// Totals of the threads that have already exited
+static metrics_counters_t metrics_retired;
+
+void metrics_observe(metrics_histogram_t *histogram, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    // Smallest bucket whose upper bound of 2^bucket microseconds holds the value
+    if (us > 1) {
+        bucket = 64 - __builtin_clzll(us - 1);
+    }
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->sum_ns, ns);
+    metrics_add(&histogram->count, 1);
+}
+
+static unsigned long long load(atomic_ullong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void fold_histogram(metrics_histogram_t *total, metrics_histogram_t *histogram) {
+    int i;
+
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        metrics_add(&total->buckets[i], load(&histogram->buckets[i]));
+    }
+    metrics_add(&total->sum_ns, load(&histogram->sum_ns));
+    metrics_add(&total->count, load(&histogram->count));
+}
+
+// Add counters into total, must be called with metrics_lock held
+static void fold_counters(metrics_counters_t *total, metrics_counters_t *counters) {
+    metrics_add(&total->connections, load(&counters->connections));
+    metrics_add(&total->disconnections, load(&counters->disconnections));
+    metrics_add(&total->packets, load(&counters->packets));
+    metrics_add(&total->bytes_in, load(&counters->bytes_in));
+    metrics_add(&total->bytes_out, load(&counters->bytes_out));
+    metrics_add(&total->lock_wait_ns, load(&counters->lock_wait_ns));
+    metrics_add(&total->connections_refused, load(&counters->connections_refused));
+    metrics_add(&total->throttled_ns, load(&counters->throttled_ns));
+    fold_histogram(&total->store_write, &counters->store_write);
+    fold_histogram(&total->store_read, &counters->store_read);
+    fold_histogram(&total->store_query, &counters->store_query);
+}
+
+int metrics_thread_register(void) {
+    metrics_counters_t *counters;
+
+    counters = aligned_alloc(_Alignof(metrics_counters_t), sizeof(metrics_counters_t));
+    if (counters == NULL) {
+        return -1;
+    }
+    memset(counters, 0, sizeof(metrics_counters_t));
+
+    pthread_mutex_lock(&metrics_lock);
+    TAILQ_INSERT_TAIL(&metrics_head, counters, entries);
+    pthread_mutex_unlock(&metrics_lock);
+
+    metrics_local = counters;
+
+    return 0;
+}
+
+void metrics_thread_unregister(void) {
+    metrics_counters_t *counters = metrics_local;
+
+    if (counters == NULL) {
+        return;
+    }
+
+    metrics_local = NULL;
+
+    pthread_mutex_lock(&metrics_lock);
+    TAILQ_REMOVE(&metrics_head, counters, entries);
+    fold_counters(&metrics_retired, counters);
+    pthread_mutex_unlock(&metrics_lock);
+
+    free(counters);
+}
+
+static void print_counter(FILE *out, const char *name, const char *type, const char *help,
+                          unsigned long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+static void print_histogram(FILE *out, const char *name, const char *help, metrics_histogram_t *histogram) {
+    unsigned long long cumulative = 0;
+    int i;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += load(&histogram->buckets[i]);
+        fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << i) / 1e6, cumulative);
+    }
+    cumulative += load(&histogram->buckets[i]);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+    fprintf(out, "%s_sum %.9f\n", name, load(&histogram->sum_ns) / 1e9);
+    fprintf(out, "%s_count %llu\n", name, load(&histogram->count));
+}
+
+static void metrics_print(FILE *out) {
+    static metrics_counters_t total;
+    metrics_counters_t *counters;
+
+    memset(&total, 0, sizeof(total));
+
+    pthread_mutex_lock(&metrics_lock);
+    fold_counters(&total, &metrics_retired);
+    TAILQ_FOREACH(counters, &metrics_head, entries) {
+        fold_counters(&total, counters);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    print_counter(out, "aesdsocket_connections_total", "counter", "Connections accepted and admitted.",
+                  load(&total.connections));
+    print_counter(out, "aesdsocket_connections_active", "gauge", "Connections currently open.",
+                  load(&total.connections) - load(&total.disconnections));
+    print_counter(out, "aesdsocket_connections_refused_total", "counter",
+                  "Connections closed right away because too many were open.", load(&total.connections_refused));
+    print_counter(out, "aesdsocket_packets_total", "counter", "Packets received from clients.",
+                  load(&total.packets));
+    print_counter(out, "aesdsocket_received_bytes_total", "counter", "Bytes received from clients.",
+                  load(&total.bytes_in));
+    print_counter(out, "aesdsocket_sent_bytes_total", "counter", "Bytes sent to clients.",
+                  load(&total.bytes_out));
+    fprintf(out, "# HELP aesdsocket_store_lock_wait_seconds_total Time spent waiting for the store lock.\n"
+                 "# TYPE aesdsocket_store_lock_wait_seconds_total counter\n"
+                 "aesdsocket_store_lock_wait_seconds_total %.9f\n", load(&total.lock_wait_ns) / 1e9);
+    fprintf(out, "# HELP aesdsocket_throttled_seconds_total Time connections were held back by rate limits.\n"
+                 "# TYPE aesdsocket_throttled_seconds_total counter\n"
+                 "aesdsocket_throttled_seconds_total %.9f\n", load(&total.throttled_ns) / 1e9);
+    print_histogram(out, "aesdsocket_store_write_seconds", "Latency of appending to the store.",
+                    &total.store_write);
+    print_histogram(out, "aesdsocket_store_read_seconds", "Latency of sending the store contents to a client.",
+                    &total.store_read);
+    print_histogram(out, "aesdsocket_store_query_seconds", "Latency of searching the store and sending the matches to a client.",
+                    &total.store_query);
+}
+
+int metrics_socket_create(unsigned short port) {
+    struct sockaddr_in address;
+    int metrics_fd, opt = 1;
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0) {
+        return -1;
+    }
+
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // Only expose the metrics on the loopback interface
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(metrics_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(metrics_fd, 4) < 0) {
+        close(metrics_fd);
+        return -1;
+    }
+
+    return metrics_fd;
+}
+
+/**
+ * Accept a scrape. Its socket is non-blocking and the event loop reads the
+ * request and sends the reply as the client keeps up, so a slow or silent
+ * client never stalls the loop, it is only dropped once METRICS_TIMEOUT_MS
+ * have passed.
+ * @return -1 if no client could be accepted
+ */
+int metrics_accept(int metrics_fd, metrics_client_t *client) {
+    client->fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client->fd < 0) {
+        return -1;
+    }
+
+    client->events = POLLIN;
+    client->deadline_ns = metrics_now_ns() + METRICS_TIMEOUT_MS * 1000000ULL;
+    client->body = NULL;
+    client->length = 0;
+    client->sent = 0;
+
+    return 0;
+}
+
+void metrics_client_close(metrics_client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    free(client->body);
+    client->body = NULL;
+}
+
+// Drop the client if the scrape has not completed by its deadline
+void metrics_client_expire(metrics_client_t *client, uint64_t now_ns) {
+    if (client->fd >= 0 && now_ns >= client->deadline_ns) {
+        metrics_client_close(client);
+    }
+}
+
+// Any request gets the full metrics page, formatted once the request arrives
+static int metrics_format(metrics_client_t *client) {
+    FILE *out;
+
+    out = open_memstream(&client->body, &client->length);
+    if (out == NULL) {
+        return -1;
+    }
+    fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+    metrics_print(out);
+    fclose(out);
+
+    return 0;
+}
+
+// Carry the scrape on as far as the socket allows, closing it once the reply is sent
+void metrics_handle_client(metrics_client_t *client) {
+    char request[METRICS_BUFFER_SIZE];
+    ssize_t rc;
+
+    if (client->events == POLLIN) {
+        // Consume the request so closing the socket doesn't reset the connection
+        rc = read(client->fd, request, sizeof(request));
+        if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (metrics_format(client) < 0) {
+            metrics_client_close(client);
+            return;
+        }
+        client->events = POLLOUT;
+    }
+
+    while (client->sent < client->length) {
+        rc = send(client->fd, client->body + client->sent, client->length - client->sent, MSG_NOSIGNAL);
+        if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (rc <= 0) {
+            break;
+        }
+        client->sent += rc;
+    }
+
+    metrics_client_close(client);
+}
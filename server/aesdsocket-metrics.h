@@ -0,0 +1,88 @@
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/queue.h>
+
+// Loopback port serving the metrics in Prometheus text format, overridden with -M
+#define METRICS_PORT 9001
+#define METRICS_BUFFER_SIZE 1024
+// Time a scrape gets to send its request and read the reply before it is dropped
+#define METRICS_TIMEOUT_MS 200
+// Bucket i of a latency histogram counts observations up to 2^i microseconds,
+// the last bucket counts everything slower
+#define METRICS_HISTOGRAM_BUCKETS 20
+
+typedef struct {
+    atomic_ullong buckets[METRICS_HISTOGRAM_BUCKETS];
+    atomic_ullong sum_ns;
+    atomic_ullong count;
+} metrics_histogram_t;
+
+/**
+ * Counters owned by a single thread. Only the owning thread writes them, so
+ * updates are plain relaxed load/store pairs with no locked instructions, and
+ * the alignment keeps each thread's counters on cache lines of their own.
+ * The scraper reads them with relaxed loads while holding the registry lock.
+ */
+typedef struct metrics_counters {
+    atomic_ullong connections;
+    atomic_ullong disconnections;
+    atomic_ullong packets;
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    atomic_ullong lock_wait_ns;
+    atomic_ullong connections_refused;
+    atomic_ullong throttled_ns;
+    metrics_histogram_t store_write;
+    metrics_histogram_t store_read;
+    metrics_histogram_t store_query;
+    TAILQ_ENTRY(metrics_counters) entries;
+} __attribute__((aligned(64))) metrics_counters_t;
+
+extern __thread metrics_counters_t *metrics_local;
+
+static inline void metrics_add(atomic_ullong *counter, unsigned long long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Add to one of the calling thread's counters, e.g. METRICS_ADD(packets, 1)
+#define METRICS_ADD(field, value) \
+    do { if (metrics_local) metrics_add(&metrics_local->field, (value)); } while (0)
+
+void metrics_observe(metrics_histogram_t *histogram, uint64_t ns);
+
+#define METRICS_OBSERVE(field, ns) \
+    do { if (metrics_local) metrics_observe(&metrics_local->field, (ns)); } while (0)
+
+int metrics_thread_register(void);
+void metrics_thread_unregister(void);
+
+// The scrape being served by the event loop, only one at a time
+typedef struct {
+    int fd;                // -1 while no scrape is in progress
+    short events;          // POLLIN until the request is read, then POLLOUT for the reply
+    uint64_t deadline_ns;  // CLOCK_MONOTONIC time the client is dropped at
+    char *body;
+    size_t length;
+    size_t sent;
+} metrics_client_t;
+
+int metrics_socket_create(unsigned short port);
+int metrics_accept(int metrics_fd, metrics_client_t *client);
+void metrics_client_close(metrics_client_t *client);
+void metrics_client_expire(metrics_client_t *client, uint64_t now_ns);
+void metrics_handle_client(metrics_client_t *client);
+
+#endif
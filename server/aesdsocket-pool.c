@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "aesdsocket-pool.h"
+#include "aesdsocket-log.h"
+
+/**
+ * One mapping split into POOL_ARENA_SIZE arenas, only used by the main thread,
+ * which accepts and reaps the connections. Arenas are carved off the mapping
+ * the first time they are needed, so memory is only committed for as many
+ * connections as were ever open at once.
+ */
+static struct {
+    char *base;
+    size_t length;
+    size_t count;
+    size_t carved;
+    arena_t *free;
+} pool;
+
+/**
+ * Map room for count arenas. With huge_pages the pool is backed by explicit
+ * huge pages, and failing those, by transparent ones where the kernel has them,
+ * saving TLB misses when many connections are open.
+ */
+int pool_init(size_t count, int huge_pages) {
+    size_t length = count * POOL_ARENA_SIZE;
+    void *base = MAP_FAILED;
+
+    if (huge_pages) {
+        length = (length + POOL_HUGE_PAGE_SIZE - 1) & ~(size_t)(POOL_HUGE_PAGE_SIZE - 1);
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            AESD_LOG(LOG_WARNING, "No huge pages for the buffer pool (%m), using transparent ones");
+        }
+    }
+
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge_pages) {
+            madvise(base, length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    pool.base = base;
+    pool.length = length;
+    pool.count = length / POOL_ARENA_SIZE;
+    pool.carved = 0;
+    pool.free = NULL;
+
+    return 0;
+}
+
+void pool_cleanup(void) {
+    if (pool.base) {
+        munmap(pool.base, pool.length);
+    }
+    pool.base = NULL;
+}
+
+// @return an empty arena, or NULL when all of them are in use
+arena_t *pool_get(void) {
+    arena_t *arena = pool.free;
+
+    if (arena) {
+        pool.free = arena->free_next;
+    } else if (pool.carved < pool.count) {
+        arena = (arena_t *)(pool.base + pool.carved++ * POOL_ARENA_SIZE);
+        arena->end = (char *)arena + POOL_ARENA_SIZE;
+    } else {
+        return NULL;
+    }
+
+    // The arena header takes up the first cache line
+    arena->next = (char *)arena + POOL_ALIGN;
+
+    return arena;
+}
+
+void pool_put(arena_t *arena) {
+    if (arena) {
+        arena->free_next = pool.free;
+        pool.free = arena;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef AESDSOCKET_POOL_H
+#define AESDSOCKET_POOL_H
+
+#include <stddef.h>
+
+// Memory each connection gets, enough for its I/O buffer and protocol state
+#define POOL_ARENA_SIZE (64 * 1024)
+// Every allocation starts on a cache line of its own
+#define POOL_ALIGN 64
+// The pool is rounded up to whole huge pages when backed by them
+#define POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * The memory of one connection, taken from the pool when it is accepted and
+ * returned in one piece once it is reaped, so serving it never goes to the
+ * heap. Allocations are bumped off the front and never freed one by one, nor
+ * zeroed: callers initialize what they allocate.
+ */
+typedef struct arena {
+    char *next;
+    char *end;
+    struct arena *free_next;  // Next free arena, while in the pool
+} arena_t;
+
+int pool_init(size_t count, int huge_pages);
+void pool_cleanup(void);
+arena_t *pool_get(void);
+void pool_put(arena_t *arena);
+
+// @return size bytes aligned to POOL_ALIGN, or NULL if the arena is used up
+static inline void *arena_alloc(arena_t *arena, size_t size) {
+    char *p = arena->next;
+
+    size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    if ((size_t)(arena->end - p) < size) {
+        return NULL;
+    }
+    arena->next = p + size;
+
+    return p;
+}
+
+#endif
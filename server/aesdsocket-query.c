@@ -0,0 +1,313 @@
+// For memmem and memrchr
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "aesdsocket-query.h"
+#include "aesdsocket-store.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define QUERY_VECTOR_SIZE 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define QUERY_VECTOR_SIZE 16
+#endif
+
+// Parse a decimal command index from p, which is followed by separator
+static int query_parse_index(const char **p, char separator, uint32_t *index) {
+    unsigned long value = 0;
+    const char *digit = *p;
+
+    if (*digit < '0' || *digit > '9') {
+        return -1;
+    }
+    for (; *digit >= '0' && *digit <= '9'; digit++) {
+        value = value * 10 + (*digit - '0');
+        if (value > UINT32_MAX) {
+            return -1;
+        }
+    }
+    if (*digit != separator) {
+        return -1;
+    }
+
+    *index = value;
+    *p = digit + 1;
+
+    return 0;
+}
+
+/**
+ * Parse a CMD_QUERY or CMD_QUERY_RANGE command received in the null-terminated
+ * command of length bytes. The pattern is left pointing into command.
+ * @return -1 if the range is malformed
+ */
+int query_parse(const char *command, size_t length, query_t *query) {
+    const char *p = command + strlen(CMD_QUERY);
+    const char *end;
+
+    query->first = 0;
+    query->last = QUERY_LAST;
+
+    if (strncmp(command, CMD_QUERY_RANGE, strlen(CMD_QUERY_RANGE)) == 0) {
+        p = command + strlen(CMD_QUERY_RANGE);
+        if (query_parse_index(&p, ',', &query->first) < 0 || query_parse_index(&p, ':', &query->last) < 0 ||
+            query->last < query->first) {
+            return -1;
+        }
+    }
+
+    // The pattern runs up to the newline ending the command
+    end = memchr(p, '\n', command + length - p);
+    query->pattern = p;
+    query->pattern_length = (end ? end : command + length) - p;
+
+    return 0;
+}
+
+#ifdef QUERY_VECTOR_SIZE
+/**
+ * @return a bit for each of the QUERY_VECTOR_SIZE positions from p where the
+ * first and last bytes of the pattern, last bytes apart, both match
+ */
+static inline unsigned int query_candidates(const char *p, size_t last, char first_byte, char last_byte) {
+#if QUERY_VECTOR_SIZE == 32
+    __m256i first_block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i last_block = _mm256_loadu_si256((const __m256i *)(p + last));
+
+    return _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first_block, _mm256_set1_epi8(first_byte)),
+                                                 _mm256_cmpeq_epi8(last_block, _mm256_set1_epi8(last_byte))));
+#else
+    __m128i first_block = _mm_loadu_si128((const __m128i *)p);
+    __m128i last_block = _mm_loadu_si128((const __m128i *)(p + last));
+
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first_block, _mm_set1_epi8(first_byte)),
+                                           _mm_cmpeq_epi8(last_block, _mm_set1_epi8(last_byte))));
+#endif
+}
+#endif
+
+/**
+ * Find the first occurrence of pattern in data. A whole vector of positions is
+ * screened at once on their first and last bytes, and only the few candidates
+ * passing both are compared in full, so common first bytes such as a space or
+ * a digit cost little. Builds without SSE2 or AVX2, and the tail too short for
+ * a vector, fall back to memmem.
+ * @return the start of the occurrence, or NULL if there is none
+ */
+const char *query_find(const char *data, size_t size, const char *pattern, size_t pattern_length) {
+#ifdef QUERY_VECTOR_SIZE
+    size_t last = pattern_length - 1;
+    size_t i = 0;
+    unsigned int candidates;
+    int bit;
+#endif
+
+    if (pattern_length == 0) {
+        return data;
+    }
+    if (pattern_length > size) {
+        return NULL;
+    }
+    if (pattern_length == 1) {
+        return memchr(data, pattern[0], size);
+    }
+
+#ifdef QUERY_VECTOR_SIZE
+    for (; i + last + QUERY_VECTOR_SIZE <= size; i += QUERY_VECTOR_SIZE) {
+        candidates = query_candidates(data + i, last, pattern[0], pattern[last]);
+        while (candidates) {
+            bit = __builtin_ctz(candidates);
+            if (memcmp(data + i + bit + 1, pattern + 1, last - 1) == 0) {
+                return data + i + bit;
+            }
+            candidates &= candidates - 1;
+        }
+    }
+    data += i;
+    size -= i;
+#endif
+
+    return memmem(data, size, pattern, pattern_length);
+}
+
+static int query_result_add(query_result_t *result, const char *data, size_t length) {
+    struct iovec *iov;
+    struct iovec *previous = &result->iov[result->count - 1];
+
+    result->length += length;
+
+    // Consecutive matching commands go out as one buffer
+    if (result->count > 1 && (const char *)previous->iov_base + previous->iov_len == data) {
+        previous->iov_len += length;
+        return 0;
+    }
+
+    if (result->count == result->capacity) {
+        iov = realloc(result->iov, 2 * result->capacity * sizeof(*iov));
+        if (iov == NULL) {
+            return -1;
+        }
+        result->iov = iov;
+        result->capacity *= 2;
+    }
+
+    result->iov[result->count].iov_base = (void *)data;
+    result->iov[result->count].iov_len = length;
+    result->count++;
+
+    return 0;
+}
+
+/**
+ * Gather the commands in the size bytes at data which query matches into result,
+ * which must be zeroed or reused from an earlier query_match() call. Only complete
+ * commands are searched, a partial one at the end is not a command yet.
+ */
+int query_match(const query_t *query, const char *data, size_t size, query_result_t *result) {
+    const char *start, *end, *line, *line_end, *hit, *newline;
+    uint32_t index;
+
+    if (result->capacity == 0) {
+        result->iov = malloc(QUERY_INITIAL_MATCHES * sizeof(*result->iov));
+        if (result->iov == NULL) {
+            return -1;
+        }
+        result->capacity = QUERY_INITIAL_MATCHES;
+    }
+    result->iov[0].iov_base = NULL;
+    result->iov[0].iov_len = 0;
+    result->count = 1;
+    result->length = 0;
+
+    // Commands only hold a newline at their end, no command can contain one elsewhere
+    if (size == 0 || (query->pattern_length > 1 && memchr(query->pattern, '\n', query->pattern_length - 1))) {
+        return 0;
+    }
+
+    end = memrchr(data, '\n', size);
+    if (end == NULL) {
+        return 0;
+    }
+    end++;
+
+    // Narrow the search down to the commands in range
+    start = data;
+    for (index = 0; index < query->first && start < end; index++) {
+        start = (const char *)memchr(start, '\n', end - start) + 1;
+    }
+    if (query->last != QUERY_LAST) {
+        line = start;
+        for (index = query->first; index <= query->last && line < end; index++) {
+            line = (const char *)memchr(line, '\n', end - line) + 1;
+        }
+        end = line;
+    }
+
+    /*
+     * Search the range as a whole rather than command by command. Each match is
+     * widened to the command holding it, and the search resumes after that
+     * command, so a command is only reported once however often it matches.
+     */
+    line = start;
+    while (line < end && (hit = query_find(line, end - line, query->pattern, query->pattern_length)) != NULL) {
+        newline = memrchr(line, '\n', hit - line);
+        if (newline != NULL) {
+            line = newline + 1;
+        }
+        line_end = (const char *)memchr(hit, '\n', end - hit) + 1;
+
+        if (query_result_add(result, line, line_end - line) < 0) {
+            return -1;
+        }
+        line = line_end;
+    }
+
+    return 0;
+}
+
+void query_result_free(query_result_t *result) {
+    free(result->iov);
+    result->iov = NULL;
+    result->count = 0;
+    result->capacity = 0;
+    result->length = 0;
+}
+
+/**
+ * Send all the buffers in result, iov[0] included, in as few calls as the
+ * IOV_MAX limit allows. The buffers are consumed as they are sent.
+ * @return the number of bytes sent, or -1 on error
+ */
+ssize_t query_send(int socket_fd, query_result_t *result) {
+    struct msghdr msg;
+    struct iovec *iov = result->iov;
+    size_t remaining = result->count;
+    size_t total = 0;
+    ssize_t rc;
+
+    while (remaining > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = remaining < IOV_MAX ? remaining : IOV_MAX;
+
+        rc = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += rc;
+
+        // Skip over what was sent, which may end in the middle of a buffer
+        while (remaining > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Reply to a text mode query with the matching commands, sent straight from a
+ * snapshot of the store without holding the store lock. result is kept by the
+ * connection between queries, so its buffers are only allocated once.
+ * @return the number of bytes sent, or -1 on error
+ */
+ssize_t query_reply(int socket_fd, const query_t *query, query_result_t *result) {
+    uint64_t start = metrics_now_ns();
+    store_view_t view;
+    ssize_t sent = -1;
+
+    if (store_acquire_view(&view) < 0) {
+        AESD_LOG(LOG_ERR, "store_acquire_view: %m");
+        return -1;
+    }
+
+    if (query_match(query, view.data, view.size, result) < 0) {
+        AESD_LOG(LOG_ERR, "query_match: %m");
+    } else {
+        sent = query_send(socket_fd, result);
+    }
+
+    store_release_view(&view);
+
+    METRICS_OBSERVE(store_query, metrics_now_ns() - start);
+
+    return sent;
+}
@@ -0,0 +1,39 @@
+#ifndef AESDSOCKET_QUERY_H
+#define AESDSOCKET_QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Last command index meaning "up to the newest command"
+#define QUERY_LAST UINT32_MAX
+// Initial number of matches gathered for a reply, grown by doubling
+#define QUERY_INITIAL_MATCHES 64
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+    const char *pattern;
+    size_t pattern_length;
+} query_t;
+
+/**
+ * The matching commands as buffers pointing into a store view, adjacent ones
+ * merged. iov[0] is left free for the caller to put a header in.
+ */
+typedef struct {
+    struct iovec *iov;
+    size_t count;
+    size_t capacity;
+    size_t length;  // Bytes in the matching commands, without iov[0]
+} query_result_t;
+
+int query_parse(const char *command, size_t length, query_t *query);
+const char *query_find(const char *data, size_t size, const char *pattern, size_t pattern_length);
+int query_match(const query_t *query, const char *data, size_t size, query_result_t *result);
+void query_result_free(query_result_t *result);
+ssize_t query_send(int socket_fd, query_result_t *result);
+ssize_t query_reply(int socket_fd, const query_t *query, query_result_t *result);
+
+#endif
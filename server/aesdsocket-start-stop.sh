@@ -9,8 +9,13 @@ case "$1" in
         echo "Stopping aesdsocket"
         start-stop-daemon --stop --name aesdsocket
         ;;
+    restart)
+        # The new instance takes over the listening socket, so port 9000 stays open
+        echo "Restarting aesdsocket"
+        /usr/bin/aesdsocket -d -r
+        ;;
     *)
-        echo "Usage: $0 {start|stop}"
+        echo "Usage: $0 {start|stop|restart}"
         exit 1
         ;;
 esac
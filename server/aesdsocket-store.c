@@ -0,0 +1,692 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "aesdsocket.h"
+#include "aesdsocket-store.h"
+#include "aesdsocket-metrics.h"
+
+store_t store;
+
+static ssize_t send_all(int socket_fd, const char *data, size_t length) {
+    size_t sent = 0;
+    ssize_t rc;
+
+    while (sent < length) {
+        rc = send(socket_fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += rc;
+    }
+
+    return sent;
+}
+
+// Take the store lock, accounting the time spent waiting for it when it is contended
+static int store_lock(void) {
+    uint64_t start;
+
+    if (ticket_trylock(&store.lock) == 0) {
+        return 0;
+    }
+
+    start = metrics_now_ns();
+    ticket_lock(&store.lock);
+    METRICS_ADD(lock_wait_ns, metrics_now_ns() - start);
+
+    return 0;
+}
+
+static void store_mapping_free(store_mapping_t *mapping) {
+#if USE_AESD_CHAR_DEVICE == 1
+    free(mapping->addr);
+#else
+    munmap(mapping->addr, mapping->length);
+#endif
+    free(mapping);
+}
+
+static void store_mapping_put(store_mapping_t *mapping) {
+    if (atomic_fetch_sub(&mapping->refcount, 1) == 1) {
+#if USE_AESD_CHAR_DEVICE == 1
+        // Keep it for the next refresh, whichever spare it replaces is freed
+        mapping = atomic_exchange(&store.spare, mapping);
+        if (mapping == NULL) {
+            return;
+        }
+#endif
+        store_mapping_free(mapping);
+    }
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+static ssize_t read_all(int fd, char *data, size_t length) {
+    size_t got = 0;
+    ssize_t rc;
+
+    while (got < length) {
+        rc = read(fd, data + got, length - got);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            break;
+        }
+        got += rc;
+    }
+
+    return got;
+}
+
+/**
+ * Ask the device for the sequence number its next command will get and the size of
+ * its contents. Together they tell whether anything was written since the copy was
+ * made, through aesdsocket or any other process, as the driver numbers every command.
+ */
+static int store_device_state(uint64_t *next_seq, size_t *size) {
+    struct aesd_seektime seektime = { .timestamp_ns = UINT64_MAX };
+    off_t end;
+
+    // No command is that recent, so this positions at the end of the data
+    if (ioctl(store.fd, AESDCHAR_IOCSEEKTIME, &seektime) < 0) {
+        return -1;
+    }
+    end = lseek(store.fd, 0, SEEK_CUR);
+    if (end < 0) {
+        return -1;
+    }
+
+    *next_seq = seektime.seq;
+    *size = end;
+
+    return 0;
+}
+
+/**
+ * How many bytes at the start of the device are the newest of the copy: the
+ * commands from the oldest one the device holds up to store.cache_seq. The driver
+ * never changes a command once written, so those bytes need not be read again.
+ */
+static int store_device_kept(uint64_t next_seq, size_t size, size_t *keep) {
+    struct aesd_seektime oldest = { .timestamp_ns = 0 };
+    struct aesd_seekto seekto;
+    off_t pos;
+
+    *keep = 0;
+    if (store.mapping == NULL || store.cache_seq >= next_seq) {
+        // Nothing cached, or a device which has been reset underneath the copy
+        return 0;
+    }
+
+    // Time 0 finds the oldest command, or next_seq when the device is empty
+    if (ioctl(store.fd, AESDCHAR_IOCSEEKTIME, &oldest) < 0) {
+        return -1;
+    }
+    if (store.cache_seq < oldest.seq) {
+        return 0;
+    }
+
+    // Where the first command written after the copy starts
+    seekto.write_cmd = store.cache_seq - oldest.seq;
+    seekto.write_cmd_offset = 0;
+    if (ioctl(store.fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+        // Evicted since by another writer, which the caller notices and starts over
+        return errno == EINVAL ? 0 : -1;
+    }
+    pos = lseek(store.fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        return -1;
+    }
+
+    if ((size_t)pos <= store.size && (size_t)pos <= size) {
+        *keep = pos;
+    }
+
+    return 0;
+}
+
+// A mapping of at least length bytes for a new copy, the spare one if it is large enough
+static store_mapping_t *store_cache_alloc(size_t length) {
+    store_mapping_t *mapping = atomic_exchange(&store.spare, NULL);
+
+    if (mapping && mapping->length < length) {
+        store_mapping_free(mapping);
+        mapping = NULL;
+    }
+    if (mapping == NULL) {
+        mapping = malloc(sizeof(store_mapping_t));
+        if (mapping == NULL) {
+            return NULL;
+        }
+        mapping->length = STORE_INITIAL_CACHE_LENGTH;
+        while (mapping->length < length) {
+            mapping->length *= 2;
+        }
+        mapping->addr = malloc(mapping->length);
+        if (mapping->addr == NULL) {
+            free(mapping);
+            return NULL;
+        }
+    }
+    atomic_init(&mapping->refcount, 1);
+
+    return mapping;
+}
+
+/**
+ * Bring the copy of the device contents up to date, must be called with store.lock held.
+ *
+ * The device is checked before every reply, as other processes may write to it
+ * too. When its next sequence number or size differ from the copy's, the commands
+ * the driver evicted are dropped from the front of the copy and only the commands
+ * added since are read. A write landing while that is going on changes the
+ * sequence number, then the whole refresh is done again.
+ */
+static int store_cache_refresh(void) {
+    store_mapping_t *mapping;
+    uint64_t next_seq, check_seq;
+    size_t size, check_size, keep, dropped;
+    ssize_t got;
+
+    if (store.fd < 0) {
+        store.fd = open(AESD_CHAR_DEVICE_PATH, O_RDONLY);
+        if (store.fd < 0) {
+            return -1;
+        }
+    }
+
+    if (store_device_state(&next_seq, &size) < 0) {
+        return -1;
+    }
+
+    while (next_seq != store.cache_seq || size != store.size) {
+        if (store_device_kept(next_seq, size, &keep) < 0) {
+            return -1;
+        }
+
+        // Append in place when nothing was dropped and it fits, readers never look past their size
+        mapping = store.mapping;
+        if (!(mapping && keep == store.size && size <= mapping->length)) {
+            mapping = store_cache_alloc(size);
+            if (mapping == NULL) {
+                return -1;
+            }
+            if (keep) {
+                memcpy(mapping->addr, store.mapping->addr + (store.size - keep), keep);
+            }
+        }
+
+        got = 0;
+        if (size > keep) {
+            if (lseek(store.fd, keep, SEEK_SET) < 0) {
+                got = -1;
+            } else {
+                got = read_all(store.fd, mapping->addr + keep, size - keep);
+            }
+        }
+
+        if (got < 0 || store_device_state(&check_seq, &check_size) < 0) {
+            if (mapping != store.mapping) {
+                store_mapping_put(mapping);
+            }
+            return -1;
+        }
+
+        // Written to in the meantime, what was read may not line up with what was kept
+        if (check_seq != next_seq || check_size != size || (size_t)got != size - keep) {
+            if (mapping != store.mapping) {
+                store_mapping_put(mapping);
+            }
+            if (check_seq == next_seq && check_size == size) {
+                // Cut short with nothing written, the device is not behaving like the driver
+                errno = EIO;
+                return -1;
+            }
+            next_seq = check_seq;
+            size = check_size;
+            continue;
+        }
+
+        if (mapping != store.mapping) {
+            if (store.mapping) {
+                store_mapping_put(store.mapping);
+            }
+            store.mapping = mapping;
+        }
+
+        // Offsets of the new contents line up with the old ones only if bytes were kept or nothing was there
+        dropped = store.size - keep;
+        if (keep > 0 || store.size == 0) {
+            store.base += dropped;
+        } else {
+            store.base = 0;
+            store.epoch++;
+        }
+
+        store.size = size;
+        store.cache_seq = next_seq;
+    }
+
+    return 0;
+}
+#else
+static store_mapping_t *store_map(int fd, size_t length) {
+    store_mapping_t *mapping;
+
+    mapping = malloc(sizeof(store_mapping_t));
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    mapping->addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping->addr == MAP_FAILED) {
+        free(mapping);
+        return NULL;
+    }
+
+    mapping->length = length;
+    atomic_init(&mapping->refcount, 1);
+
+    return mapping;
+}
+
+// Make sure the mapping covers store.size bytes, must be called with store.lock held
+static int store_grow_mapping(void) {
+    store_mapping_t *mapping;
+    size_t length = store.mapping ? store.mapping->length : STORE_INITIAL_MAP_LENGTH;
+
+    if (store.mapping && store.size <= store.mapping->length) {
+        return 0;
+    }
+
+    while (length < store.size) {
+        length *= 2;
+    }
+
+    // Map the file past its current end so the mapping only has to be replaced
+    // when the store doubles in size. Readers never touch bytes beyond store.size.
+    mapping = store_map(store.fd, length);
+    if (mapping == NULL) {
+        return -1;
+    }
+
+    if (store.mapping) {
+        store_mapping_put(store.mapping);
+    }
+    store.mapping = mapping;
+
+    return 0;
+}
+
+// Record the command boundaries found in data, which was stored at offset base.
+// Must be called with store.lock held.
+static int store_index_scan(const char *data, size_t length, size_t base) {
+    const char *p = data;
+    const char *end = data + length;
+    size_t *index;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+
+        if (store.index_count + 1 == store.index_capacity) {
+            index = realloc(store.index, 2 * store.index_capacity * sizeof(size_t));
+            if (index == NULL) {
+                return -1;
+            }
+            store.index = index;
+            store.index_capacity *= 2;
+        }
+
+        store.index[++store.index_count] = base + (p - data);
+    }
+
+    return 0;
+}
+#endif
+
+int store_init(void) {
+    if (ticket_lock_init(&store.lock) != 0) {
+        return -1;
+    }
+
+    store.fd = -1;
+    store.size = 0;
+    store.mapping = NULL;
+    store.version = 0;
+    store.base = 0;
+    store.epoch = 0;
+
+#if USE_AESD_CHAR_DEVICE == 1
+    // The device is read for the first reply, by then it has been created
+    store.cache_seq = 0;
+    atomic_init(&store.spare, NULL);
+#endif
+
+#if USE_AESD_CHAR_DEVICE != 1
+    struct stat st;
+
+    // Open the file /var/tmp/aesdsocketdata once, shared by all connections
+    store.fd = open(AESD_CHAR_DEVICE_PATH, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (store.fd < 0) {
+        return -1;
+    }
+
+    if (fstat(store.fd, &st) < 0) {
+        close(store.fd);
+        return -1;
+    }
+    store.size = st.st_size;
+
+    if (store_grow_mapping() < 0) {
+        close(store.fd);
+        return -1;
+    }
+
+    store.index = malloc(STORE_INITIAL_INDEX_CAPACITY * sizeof(size_t));
+    if (store.index == NULL) {
+        close(store.fd);
+        return -1;
+    }
+    store.index[0] = 0;
+    store.index_count = 0;
+    store.index_capacity = STORE_INITIAL_INDEX_CAPACITY;
+
+    // Rebuild the command index from whatever the file already holds
+    if (store_index_scan(store.mapping->addr, store.size, 0) < 0) {
+        close(store.fd);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+void store_cleanup(int remove_data) {
+    if (store.mapping) {
+        store_mapping_put(store.mapping);
+        store.mapping = NULL;
+    }
+
+#if USE_AESD_CHAR_DEVICE != 1
+    free(store.index);
+    store.index = NULL;
+    close(store.fd);
+    if (remove_data) {
+        unlink(AESD_CHAR_DEVICE_PATH);
+    }
+#else
+    (void)remove_data;
+    if (store.fd >= 0) {
+        close(store.fd);
+    }
+    if (atomic_load(&store.spare)) {
+        store_mapping_free(atomic_exchange(&store.spare, NULL));
+    }
+#endif
+    ticket_lock_destroy(&store.lock);
+}
+
+int store_flush(void) {
+    int retval = 0;
+
+#if USE_AESD_CHAR_DEVICE != 1
+    ticket_lock(&store.lock);
+    retval = fdatasync(store.fd);
+    ticket_unlock(&store.lock);
+#endif
+
+    return retval;
+}
+
+int store_handle_open(store_handle_t *handle) {
+    handle->fd = -1;
+    handle->pos = 0;
+    handle->delta = 0;
+    handle->seen = 0;
+    handle->epoch = 0;
+
+#if USE_AESD_CHAR_DEVICE == 1
+    // Each connection needs its own file position on the char device
+    handle->fd = open(AESD_CHAR_DEVICE_PATH, O_RDWR);
+    if (handle->fd < 0) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+void store_handle_close(store_handle_t *handle) {
+    if (handle->fd >= 0) {
+        close(handle->fd);
+        handle->fd = -1;
+    }
+}
+
+int store_append(store_handle_t *handle, const char *data, size_t length) {
+    uint64_t start = metrics_now_ns();
+    size_t written = 0;
+    ssize_t rc;
+    int retval = 0;
+
+    if (store_lock()) {
+        return -1;
+    }
+
+#if USE_AESD_CHAR_DEVICE == 1
+    while (written < length) {
+        rc = write(handle->fd, data + written, length - written);
+        if (rc < 0) {
+            retval = -1;
+            break;
+        }
+        written += rc;
+    }
+#else
+    // The file is opened with O_APPEND so every write lands at the end of the store
+    while (written < length) {
+        rc = write(store.fd, data + written, length - written);
+        if (rc < 0) {
+            retval = -1;
+            break;
+        }
+        written += rc;
+    }
+    if (store_index_scan(data, written, store.size) < 0) {
+        retval = -1;
+    }
+    store.size += written;
+
+    if (store_grow_mapping() < 0) {
+        retval = -1;
+    }
+#endif
+
+    // The reply contains the entire store contents, or what is new to a delta mode connection
+    if (handle) {
+        handle->pos = handle->delta ? STORE_POS_UNSEEN : 0;
+    }
+    store.version++;
+
+    ticket_unlock(&store.lock);
+
+    METRICS_OBSERVE(store_write, metrics_now_ns() - start);
+
+    return retval;
+}
+
+int store_seekto(store_handle_t *handle, const struct aesd_seekto *seekto) {
+#if USE_AESD_CHAR_DEVICE == 1
+    int retval;
+
+    if (store_lock()) {
+        return -1;
+    }
+
+    retval = ioctl(handle->fd, AESDCHAR_IOCSEEKTO, seekto);
+    if (retval == 0) {
+        off_t pos = lseek(handle->fd, 0, SEEK_CUR);
+
+        if (pos < 0) {
+            retval = -1;
+        } else {
+            handle->pos = pos;
+        }
+    }
+
+    ticket_unlock(&store.lock);
+
+    return retval;
+#else
+    size_t start, length;
+    int retval = 0;
+
+    if (store_lock()) {
+        return -1;
+    }
+
+    // Look up the command in the offset index, only complete commands can be seeked into
+    if (seekto->write_cmd < store.index_count) {
+        start = store.index[seekto->write_cmd];
+        length = store.index[seekto->write_cmd + 1] - start;
+        if (seekto->write_cmd_offset < length) {
+            handle->pos = start + seekto->write_cmd_offset;
+        } else {
+            errno = EINVAL;
+            retval = -1;
+        }
+    } else {
+        errno = EINVAL;
+        retval = -1;
+    }
+
+    ticket_unlock(&store.lock);
+
+    return retval;
+#endif
+}
+
+// Switch between full and delta replies, the next reply carries the entire store either way
+void store_set_delta(store_handle_t *handle, int delta) {
+    handle->delta = delta;
+    handle->pos = 0;
+}
+
+// Send the entire store with the next reply, e.g. after a delta mode client lost track
+void store_resync(store_handle_t *handle) {
+    handle->pos = 0;
+}
+
+int store_acquire_view(store_view_t *view) {
+    if (store_lock()) {
+        return -1;
+    }
+
+#if USE_AESD_CHAR_DEVICE == 1
+    if (store_cache_refresh() < 0) {
+        ticket_unlock(&store.lock);
+        return -1;
+    }
+#endif
+
+    view->version = store.version;
+    view->base = store.base;
+    view->epoch = store.epoch;
+    view->mapping = store.mapping;
+    view->data = store.mapping ? store.mapping->addr : NULL;
+    view->size = store.size;
+    if (view->mapping) {
+        atomic_fetch_add(&view->mapping->refcount, 1);
+    }
+
+    ticket_unlock(&store.lock);
+
+    return 0;
+}
+
+void store_release_view(store_view_t *view) {
+    if (view->mapping) {
+        store_mapping_put(view->mapping);
+    }
+    view->mapping = NULL;
+    view->data = NULL;
+    view->size = 0;
+}
+
+/**
+ * Work out what the next reply to handle carries: length bytes at data, which stay valid
+ * until store_reply_end() releases view
+ */
+int store_reply_begin(store_handle_t *handle, store_view_t *view, const char **data, size_t *length) {
+    size_t pos;
+
+    if (store_acquire_view(view) < 0) {
+        return -1;
+    }
+
+    /*
+     * Pick up where the last reply ended. When that is no longer in the store, because
+     * the device dropped it or the offsets changed epoch, everything there is is new.
+     */
+    pos = handle->pos;
+    if (pos == STORE_POS_UNSEEN) {
+        pos = 0;
+        if (handle->epoch == view->epoch && handle->seen > view->base) {
+            pos = handle->seen - view->base;
+        }
+    }
+
+    *data = pos < view->size ? view->data + pos : NULL;
+    *length = pos < view->size ? view->size - pos : 0;
+
+    return 0;
+}
+
+// Account a reply from store_reply_begin(), sent is negative if sending it failed
+void store_reply_end(store_handle_t *handle, store_view_t *view, ssize_t sent) {
+    if (sent >= 0) {
+        handle->seen = view->base + view->size;
+        handle->epoch = view->epoch;
+    }
+    if (handle->delta) {
+        handle->pos = STORE_POS_UNSEEN;
+    }
+
+    store_release_view(view);
+}
+
+ssize_t store_reply(store_handle_t *handle, int socket_fd) {
+    uint64_t start = metrics_now_ns();
+    store_view_t view;
+    const char *data;
+    size_t length;
+    ssize_t sent = 0;
+
+    if (store_reply_begin(handle, &view, &data, &length) < 0) {
+        return -1;
+    }
+
+    // Serve the reply from the shared snapshot, without holding the store lock
+    if (length) {
+        sent = send_all(socket_fd, data, length);
+    }
+
+    store_reply_end(handle, &view, sent);
+
+    METRICS_OBSERVE(store_read, metrics_now_ns() - start);
+
+    return sent;
+}
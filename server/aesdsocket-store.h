@@ -0,0 +1,119 @@
+#ifndef AESDSOCKET_STORE_H
+#define AESDSOCKET_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "aesdsocket.h"
+#include "aesdsocket-ticket.h"
+#include "aesd_ioctl.h"
+
+// Initial length of the file store mapping, grown by doubling as the store grows
+#define STORE_INITIAL_MAP_LENGTH (64 * 1024)
+// Initial number of command offsets in the file store index
+#define STORE_INITIAL_INDEX_CAPACITY 1024
+// Initial size of the in-memory copy of the char device contents, grown by doubling
+#define STORE_INITIAL_CACHE_LENGTH (4 * 1024)
+// Reply position meaning "whatever this delta mode connection has not seen yet"
+#define STORE_POS_UNSEEN SIZE_MAX
+
+/**
+ * A read-only mapping of the file store, or with the char device a heap copy of
+ * its contents. The store holds one reference to the current mapping and each
+ * reader holds one for the duration of its send, so a mapping replaced by a new
+ * one is released only after the last reader is done. Bytes are only ever added
+ * past the size a reader saw, so readers never see them change.
+ */
+typedef struct {
+    atomic_int refcount;
+    char *addr;
+    size_t length;
+} store_mapping_t;
+
+/**
+ * A stable snapshot of the store contents taken by store_acquire_view()
+ */
+typedef struct {
+    store_mapping_t *mapping;
+    const char *data;
+    size_t size;
+    uint64_t version;  // store.version the snapshot reflects
+    uint64_t base;     // Absolute offset of data[0], see store_t
+    uint64_t epoch;
+} store_view_t;
+
+/**
+ * Per-connection state for accessing the store. In delta mode a reply only
+ * carries the bytes added since the previous one, tracked as an absolute
+ * offset so it survives the device dropping old entries.
+ */
+typedef struct {
+    int fd;         // Device file descriptor, only used with the char device
+    size_t pos;     // Read position for the next reply, or STORE_POS_UNSEEN
+    int delta;      // Reply with new data only
+    uint64_t seen;  // Absolute offset up to which this connection has been sent the store
+    uint64_t epoch; // store epoch seen refers to
+} store_handle_t;
+
+typedef struct {
+    ticket_lock_t lock;  // Handed out in request order, so no connection can starve the others
+    int fd;
+    size_t size;
+    store_mapping_t *mapping;
+    uint64_t version;  // Bumped by every append
+    /**
+     * Absolute offset of the first stored byte, i.e. the bytes the char device
+     * has dropped so far. Offsets are only comparable within one epoch, which
+     * changes when the device contents could not be matched up with the copy.
+     * Both stay 0 with the file store, which only grows.
+     */
+    uint64_t base;
+    uint64_t epoch;
+#if USE_AESD_CHAR_DEVICE == 1
+    /**
+     * The mapping holds the device contents as of the moment the driver was about
+     * to number its next command cache_seq. Any process may write to the device,
+     * so this is compared with the device before every reply.
+     */
+    uint64_t cache_seq;
+    /**
+     * The last copy released by its final reader, reused by the next refresh that
+     * needs a new copy. Once the driver is full every append drops an entry, so
+     * every refresh needs one and would otherwise go to the heap each time.
+     */
+    _Atomic(store_mapping_t *) spare;
+#endif
+    /**
+     * Start offsets of the commands in the file store. Entry i is where command i
+     * begins, and entry index_count is where the next (possibly partial) command
+     * begins, so command i spans [index[i], index[i + 1]).
+     */
+    size_t *index;
+    size_t index_count;
+    size_t index_capacity;
+} store_t;
+
+extern store_t store;
+
+int store_init(void);
+void store_cleanup(int remove_data);
+int store_flush(void);
+
+int store_handle_open(store_handle_t *handle);
+void store_handle_close(store_handle_t *handle);
+
+int store_append(store_handle_t *handle, const char *data, size_t length);
+int store_seekto(store_handle_t *handle, const struct aesd_seekto *seekto);
+void store_set_delta(store_handle_t *handle, int delta);
+void store_resync(store_handle_t *handle);
+ssize_t store_reply(store_handle_t *handle, int socket_fd);
+int store_reply_begin(store_handle_t *handle, store_view_t *view, const char **data, size_t *length);
+void store_reply_end(store_handle_t *handle, store_view_t *view, ssize_t sent);
+
+int store_acquire_view(store_view_t *view);
+void store_release_view(store_view_t *view);
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "aesdsocket-subscribe.h"
+#include "aesdsocket-store.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+
+static subscribe_t subscribe = {
+    .event_fd = -1,
+    .handover_fds = { -1, -1 },
+};
+
+static int subscribe_grow(void) {
+    size_t capacity = subscribe.capacity ? 2 * subscribe.capacity : SUBSCRIBE_INITIAL_CAPACITY;
+    struct pollfd *fds;
+    subscriber_t *subscribers;
+
+    fds = realloc(subscribe.fds, (SUBSCRIBE_FD_COUNT + capacity) * sizeof(struct pollfd));
+    if (fds == NULL) {
+        return -1;
+    }
+    subscribe.fds = fds;
+
+    subscribers = realloc(subscribe.subscribers, capacity * sizeof(subscriber_t));
+    if (subscribers == NULL) {
+        return -1;
+    }
+    subscribe.subscribers = subscribers;
+    subscribe.capacity = capacity;
+
+    return 0;
+}
+
+// Take in a subscriber handed over by subscribe_add(), -1 once the handover socket has been closed
+static int subscribe_accept(void) {
+    subscriber_t subscriber;
+    struct pollfd *fd;
+    ssize_t rc;
+
+    rc = read(subscribe.handover_fds[0], &subscriber, sizeof(subscriber));
+    if (rc == 0) {
+        return -1;
+    }
+    if (rc != sizeof(subscriber)) {
+        return 0;
+    }
+
+    if (subscribe.count == subscribe.capacity && subscribe_grow() < 0) {
+        AESD_LOG(LOG_ERR, "Out of memory for subscribers, dropping one");
+        close(subscriber.fd);
+        atomic_fetch_sub(&subscribe.active, 1);
+        return 0;
+    }
+
+    fd = &subscribe.fds[SUBSCRIBE_FD_COUNT + subscribe.count];
+    fd->fd = subscriber.fd;
+    fd->events = POLLIN;
+    fd->revents = 0;
+    subscribe.subscribers[subscribe.count++] = subscriber;
+
+    return 0;
+}
+
+// Close subscriber i, moving the last one into its slot
+static void subscribe_remove(size_t i) {
+    size_t last = subscribe.count - 1;
+
+    close(subscribe.subscribers[i].fd);
+    subscribe.subscribers[i] = subscribe.subscribers[last];
+    subscribe.fds[SUBSCRIBE_FD_COUNT + i] = subscribe.fds[SUBSCRIBE_FD_COUNT + last];
+    subscribe.count--;
+    atomic_fetch_sub(&subscribe.active, 1);
+}
+
+/**
+ * Send every subscriber what it has not seen yet. The store contents are taken
+ * once per round as a shared, refcounted snapshot and each subscriber is sent
+ * its part of it directly, so no subscriber gets a copy of its own. Sends never
+ * block: a subscriber whose socket buffer is full is polled for room and picks
+ * up from its offset later, possibly from a newer snapshot.
+ */
+static void subscribe_send(void) {
+    subscriber_t *subscriber;
+    struct pollfd *fd;
+    store_view_t view;
+    size_t i, pos;
+    ssize_t rc;
+
+    if (subscribe.count == 0) {
+        return;
+    }
+
+    if (store_acquire_view(&view) < 0) {
+        AESD_LOG(LOG_ERR, "store_acquire_view: %m");
+        return;
+    }
+
+    for (i = 0; i < subscribe.count;) {
+        subscriber = &subscribe.subscribers[i];
+        fd = &subscribe.fds[SUBSCRIBE_FD_COUNT + i];
+
+        // Anything no longer in the store, or from another epoch, is skipped
+        pos = 0;
+        if (subscriber->epoch == view.epoch && subscriber->seen > view.base) {
+            pos = subscriber->seen - view.base;
+        }
+
+        rc = 0;
+        if (pos < view.size) {
+            rc = send(subscriber->fd, view.data + pos, view.size - pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (rc < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    subscribe_remove(i);
+                    continue;
+                }
+                rc = 0;
+            }
+            METRICS_ADD(bytes_out, rc);
+        }
+
+        subscriber->seen = view.base + pos + rc;
+        subscriber->epoch = view.epoch;
+        // Wait for room in the socket buffer only while something is left to send
+        fd->events = (fd->events & POLLIN) | (pos + rc < view.size ? POLLOUT : 0);
+        i++;
+    }
+
+    store_release_view(&view);
+}
+
+static void *subscribe_main(void *arguments) {
+    char discard[SUBSCRIBE_DISCARD_SIZE];
+    struct pollfd *fd;
+    uint64_t events;
+    size_t i;
+    ssize_t rc;
+    int dirty;
+
+    (void)arguments;
+
+    if (metrics_thread_register() < 0) {
+        AESD_LOG(LOG_ERR, "metrics_thread_register: %m");
+    }
+
+    for (;;) {
+        if (poll(subscribe.fds, SUBSCRIBE_FD_COUNT + subscribe.count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "poll: %m");
+            break;
+        }
+
+        dirty = 0;
+        if (subscribe.fds[SUBSCRIBE_FD_EVENT].revents & POLLIN) {
+            if (read(subscribe.event_fd, &events, sizeof(events)) == sizeof(events)) {
+                dirty = 1;
+            }
+        }
+
+        // Walk backwards so the subscriber moved into a removed one's slot has been handled already
+        for (i = subscribe.count; i-- > 0;) {
+            fd = &subscribe.fds[SUBSCRIBE_FD_COUNT + i];
+
+            if (fd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                subscribe_remove(i);
+                continue;
+            }
+            if (fd->revents & POLLIN) {
+                rc = recv(fd->fd, discard, sizeof(discard), MSG_DONTWAIT);
+                if (rc == 0) {
+                    // The subscriber is done sending, it may still be listening
+                    fd->events &= ~POLLIN;
+                } else if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    subscribe_remove(i);
+                    continue;
+                }
+            }
+            if (fd->revents & POLLOUT) {
+                dirty = 1;
+            }
+        }
+
+        // Subscribers added after the last notification may already be behind
+        if (subscribe.fds[SUBSCRIBE_FD_HANDOVER].revents & (POLLIN | POLLHUP)) {
+            if (subscribe_accept() < 0) {
+                break;
+            }
+            dirty = 1;
+        }
+
+        if (dirty) {
+            subscribe_send();
+        }
+    }
+
+    metrics_thread_unregister();
+    log_thread_exit();
+
+    return NULL;
+}
+
+int subscribe_init(void) {
+    int rc;
+
+    if (subscribe_grow() < 0) {
+        return -1;
+    }
+
+    subscribe.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (subscribe.event_fd < 0) {
+        return -1;
+    }
+
+    // A packet socket pair keeps each handed over subscriber in a message of its own
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, subscribe.handover_fds) < 0) {
+        close(subscribe.event_fd);
+        subscribe.event_fd = -1;
+        return -1;
+    }
+
+    subscribe.fds[SUBSCRIBE_FD_EVENT].fd = subscribe.event_fd;
+    subscribe.fds[SUBSCRIBE_FD_EVENT].events = POLLIN;
+    subscribe.fds[SUBSCRIBE_FD_HANDOVER].fd = subscribe.handover_fds[0];
+    subscribe.fds[SUBSCRIBE_FD_HANDOVER].events = POLLIN;
+    atomic_init(&subscribe.active, 0);
+
+    rc = pthread_create(&subscribe.thread, NULL, subscribe_main, NULL);
+    if (rc != 0) {
+        close(subscribe.handover_fds[0]);
+        close(subscribe.handover_fds[1]);
+        close(subscribe.event_fd);
+        subscribe.handover_fds[0] = subscribe.handover_fds[1] = subscribe.event_fd = -1;
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stop the fan-out thread and disconnect the subscribers, no connection may call subscribe_add() anymore
+void subscribe_shutdown(void) {
+    size_t i;
+
+    if (subscribe.handover_fds[1] < 0) {
+        return;
+    }
+
+    // The fan-out thread exits when it reads the end of the handover socket
+    close(subscribe.handover_fds[1]);
+    subscribe.handover_fds[1] = -1;
+    pthread_join(subscribe.thread, NULL);
+
+    for (i = 0; i < subscribe.count; i++) {
+        close(subscribe.subscribers[i].fd);
+    }
+    subscribe.count = 0;
+
+    close(subscribe.handover_fds[0]);
+    close(subscribe.event_fd);
+    subscribe.handover_fds[0] = subscribe.event_fd = -1;
+
+    free(subscribe.fds);
+    free(subscribe.subscribers);
+    subscribe.fds = NULL;
+    subscribe.subscribers = NULL;
+    subscribe.capacity = 0;
+}
+
+/**
+ * Turn a connection into a subscriber, which from now on is sent whatever is
+ * appended to the store. The fan-out thread takes its own duplicate of the
+ * socket, the caller still closes socket_fd as usual.
+ */
+int subscribe_add(int socket_fd) {
+    subscriber_t subscriber;
+    store_view_t view;
+
+    if (subscribe.handover_fds[1] < 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Start from the current end, a subscriber only watches new data
+    if (store_acquire_view(&view) < 0) {
+        return -1;
+    }
+    subscriber.seen = view.base + view.size;
+    subscriber.epoch = view.epoch;
+    store_release_view(&view);
+
+    subscriber.fd = fcntl(socket_fd, F_DUPFD_CLOEXEC, 0);
+    if (subscriber.fd < 0) {
+        return -1;
+    }
+
+    // Counted before the handover so no notification is skipped in between
+    atomic_fetch_add(&subscribe.active, 1);
+    if (send(subscribe.handover_fds[1], &subscriber, sizeof(subscriber), MSG_NOSIGNAL) != sizeof(subscriber)) {
+        atomic_fetch_sub(&subscribe.active, 1);
+        close(subscriber.fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Wake the fan-out thread after an append, nothing to do while nobody is subscribed
+void subscribe_notify(void) {
+    uint64_t one = 1;
+
+    if (atomic_load_explicit(&subscribe.active, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    // Only fails when the counter is about to overflow, in which case a wakeup is pending anyway
+    if (write(subscribe.event_fd, &one, sizeof(one)) < 0) {
+        return;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef AESDSOCKET_SUBSCRIBE_H
+#define AESDSOCKET_SUBSCRIBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+
+// Initial number of subscribers the fan-out thread has room for, grown by doubling
+#define SUBSCRIBE_INITIAL_CAPACITY 64
+// Input from a subscriber is read into this and dropped
+#define SUBSCRIBE_DISCARD_SIZE 512
+
+// Slots at the start of the fan-out thread's poll set, subscriber sockets follow
+enum {
+    SUBSCRIBE_FD_EVENT,    // eventfd signalled by subscribe_notify()
+    SUBSCRIBE_FD_HANDOVER, // New subscribers handed over by subscribe_add()
+    SUBSCRIBE_FD_COUNT,
+};
+
+/**
+ * A connection that only receives what is appended to the store. Like a delta
+ * mode connection it tracks the absolute offset it has been sent up to, so data
+ * the char device has already dropped is skipped instead of waited for.
+ */
+typedef struct {
+    int fd;
+    uint64_t seen;
+    uint64_t epoch;
+} subscriber_t;
+
+/**
+ * Everything but the fds written to is owned by the fan-out thread, so it needs
+ * no lock. Entry i + SUBSCRIBE_FD_COUNT of fds is the socket of subscribers[i].
+ */
+typedef struct {
+    pthread_t thread;
+    int event_fd;
+    int handover_fds[2];
+    atomic_int active;  // Number of subscribers, checked by subscribe_notify()
+    struct pollfd *fds;
+    subscriber_t *subscribers;
+    size_t count;
+    size_t capacity;
+} subscribe_t;
+
+int subscribe_init(void);
+void subscribe_shutdown(void);
+
+int subscribe_add(int socket_fd);
+void subscribe_notify(void);
+
+#endif
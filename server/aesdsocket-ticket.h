@@ -0,0 +1,95 @@
+#ifndef AESDSOCKET_TICKET_H
+#define AESDSOCKET_TICKET_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Condition variables waiters are spread over, so an unlock only wakes about 1/n of them
+#define TICKET_LOCK_SLOTS 16
+
+/**
+ * A FIFO lock: threads get the lock in the order they asked for it, so a
+ * connection hammering the store cannot keep grabbing it back from the ones
+ * waiting, as it can with a plain mutex. Taking a free lock is one atomic
+ * add. Waiters sleep on the slot of their ticket and the mutex only guards
+ * sleeping and waking.
+ */
+typedef struct {
+    atomic_uint next;     // Ticket handed to the next thread asking for the lock
+    atomic_uint serving;  // Ticket of the thread allowed to hold the lock
+    atomic_uint waiters;  // Threads asleep in ticket_lock()
+    pthread_mutex_t mutex;
+    pthread_cond_t slots[TICKET_LOCK_SLOTS];
+} ticket_lock_t;
+
+static inline int ticket_lock_init(ticket_lock_t *lock) {
+    int i;
+
+    atomic_init(&lock->next, 0);
+    atomic_init(&lock->serving, 0);
+    atomic_init(&lock->waiters, 0);
+    if (pthread_mutex_init(&lock->mutex, NULL) != 0) {
+        return -1;
+    }
+    for (i = 0; i < TICKET_LOCK_SLOTS; i++) {
+        if (pthread_cond_init(&lock->slots[i], NULL) != 0) {
+            while (i--) {
+                pthread_cond_destroy(&lock->slots[i]);
+            }
+            pthread_mutex_destroy(&lock->mutex);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline void ticket_lock_destroy(ticket_lock_t *lock) {
+    int i;
+
+    for (i = 0; i < TICKET_LOCK_SLOTS; i++) {
+        pthread_cond_destroy(&lock->slots[i]);
+    }
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+// Take the lock only if nobody holds it or is waiting for it, 0 on success
+static inline int ticket_trylock(ticket_lock_t *lock) {
+    unsigned int ticket = atomic_load(&lock->serving);
+
+    return atomic_compare_exchange_strong(&lock->next, &ticket, ticket + 1) ? 0 : -1;
+}
+
+static inline void ticket_lock(ticket_lock_t *lock) {
+    unsigned int ticket = atomic_fetch_add(&lock->next, 1);
+    pthread_cond_t *slot = &lock->slots[ticket % TICKET_LOCK_SLOTS];
+
+    if (atomic_load(&lock->serving) == ticket) {
+        return;
+    }
+
+    // Registered as a waiter before checking again, ticket_unlock() does the opposite,
+    // so either this thread sees its turn or the unlocking thread sees a waiter
+    pthread_mutex_lock(&lock->mutex);
+    atomic_fetch_add(&lock->waiters, 1);
+    while (atomic_load(&lock->serving) != ticket) {
+        pthread_cond_wait(slot, &lock->mutex);
+    }
+    atomic_fetch_sub(&lock->waiters, 1);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void ticket_unlock(ticket_lock_t *lock) {
+    unsigned int serving = atomic_fetch_add(&lock->serving, 1) + 1;
+
+    if (atomic_load(&lock->waiters) == 0) {
+        return;
+    }
+
+    // Other tickets can share the slot, they go back to sleep
+    pthread_mutex_lock(&lock->mutex);
+    pthread_cond_broadcast(&lock->slots[serving % TICKET_LOCK_SLOTS]);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+#endif
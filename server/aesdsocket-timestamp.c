@@ -0,0 +1,142 @@
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+#include "aesdsocket-timestamp.h"
+#include "aesdsocket-store.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+#include "aesdsocket-subscribe.h"
+
+static timestamps_t timestamps = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+int timestamp_timer_create(unsigned long interval_ms) {
+    struct itimerspec spec;
+    int timer_fd;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return -1;
+    }
+
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    // Fire right away so the first timestamp is written at startup
+    spec.it_value.tv_sec = 0;
+    spec.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0) {
+        close(timer_fd);
+        return -1;
+    }
+
+    return timer_fd;
+}
+
+// Append queued records until told to stop, then append whatever is left
+static void *timestamp_main(void *arguments) {
+    timestamp_record_t record;
+
+    (void)arguments;
+
+    if (metrics_thread_register() < 0) {
+        AESD_LOG(LOG_ERR, "metrics_thread_register: %m");
+    }
+
+    pthread_mutex_lock(&timestamps.lock);
+    for (;;) {
+        while (timestamp_ring_empty(&timestamps.queue) && !timestamps.stopping) {
+            pthread_cond_wait(&timestamps.cond, &timestamps.lock);
+        }
+        if (!timestamp_ring_pop(&timestamps.queue, &record)) {
+            break;
+        }
+        pthread_mutex_unlock(&timestamps.lock);
+
+        // Append the timestamp to the end of the store, the same way client data is appended
+        if (store_append(NULL, record.text, record.length) < 0) {
+            AESD_LOG(LOG_ERR, "store_append: %m");
+        }
+        subscribe_notify();
+
+        pthread_mutex_lock(&timestamps.lock);
+    }
+    pthread_mutex_unlock(&timestamps.lock);
+
+    metrics_thread_unregister();
+    log_thread_exit();
+
+    return NULL;
+}
+
+int timestamp_init(void) {
+    int rc;
+
+    timestamp_ring_init(&timestamps.queue);
+    timestamps.stopping = 0;
+
+    rc = pthread_create(&timestamps.thread, NULL, timestamp_main, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    timestamps.running = 1;
+
+    return 0;
+}
+
+// Stop the writer thread once it has appended the records still queued
+void timestamp_shutdown(void) {
+    if (!timestamps.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&timestamps.lock);
+    timestamps.stopping = 1;
+    pthread_cond_signal(&timestamps.cond);
+    pthread_mutex_unlock(&timestamps.lock);
+
+    pthread_join(timestamps.thread, NULL);
+    timestamps.running = 0;
+}
+
+/**
+ * Handle an expiration of the timer on the event loop: format the record and
+ * queue it for the writer thread, which is the only place it waits on the store.
+ */
+void timestamp(int timer_fd) {
+    static timestamp_record_t record;
+    static time_t cached_second = -1;
+    struct timespec now;
+    struct tm timeinfo;
+    uint64_t expirations;
+    enum aesd_ring_push_result result;
+
+    // Consume the expiration count so the timer fd stops polling readable
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    // Only format the string again when the second has changed, so short
+    // intervals queue the cached record instead of calling strftime each time
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != cached_second) {
+        localtime_r(&now.tv_sec, &timeinfo);
+        record.length = strftime(record.text, sizeof(record.text), "timestamp:%Y-%m-%d %H:%M:%S\n", &timeinfo);
+        cached_second = now.tv_sec;
+    }
+
+    pthread_mutex_lock(&timestamps.lock);
+    result = timestamp_ring_push(&timestamps.queue, &record, NULL);
+    pthread_cond_signal(&timestamps.cond);
+    pthread_mutex_unlock(&timestamps.lock);
+
+    if (result == AESD_RING_FULL) {
+        AESD_LOG(LOG_WARNING, "Timestamp writer is behind, dropping a timestamp");
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef AESDSOCKET_TIMESTAMP_H
+#define AESDSOCKET_TIMESTAMP_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "aesd-ring.h"
+
+// Default interval between timestamp records, overridden with -t
+#define TIMESTAMP_INTERVAL_MS 10000
+#define TIMESTAMP_BUFFER_SIZE 64
+// Records waiting for the writer thread, further ones are dropped while it is stuck
+#define TIMESTAMP_QUEUE_LENGTH 16
+
+typedef struct {
+    char text[TIMESTAMP_BUFFER_SIZE];
+    size_t length;
+} timestamp_record_t;
+
+AESD_RING_DEFINE(timestamp_ring, timestamp_record_t, TIMESTAMP_QUEUE_LENGTH, AESD_RING_REJECT)
+
+/**
+ * Records formatted by the event loop, appended to the store by a writer thread
+ * of their own so the event loop never waits for the store lock behind the
+ * connection threads.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // Signalled when a record is queued or the writer should stop
+    struct timestamp_ring queue;
+    int running;          // Whether the writer thread was started
+    int stopping;
+} timestamps_t;
+
+int timestamp_timer_create(unsigned long interval_ms);
+int timestamp_init(void);
+void timestamp_shutdown(void);
+void timestamp(int timer_fd);
+
+#endif
@@ -7,319 +7,905 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/queue.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <pthread.h>
 
 #include "aesdsocket.h"
+#include "aesdsocket-store.h"
+#include "aesdsocket-control.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-log.h"
+#include "aesdsocket-subscribe.h"
+#include "aesdsocket-binary.h"
+#include "aesdsocket-query.h"
+#include "aesdsocket-timestamp.h"
 #include "aesd_ioctl.h"
 
 aesdsocket_options_t options;
-file_options_t file_options;
-thread_list_head_t thread_list_head;
-
-void handle_signal(int signal) {
-    thread_list_t *thread_list_entry;
-
-    if (signal == SIGINT || signal == SIGTERM) {
-        syslog(LOG_INFO, "Received signal %d", signal);
-        printf("Received signal %d\n", signal);
-
-#if USE_AESD_CHAR_DEVICE != 1
-        system("rm -f /var/tmp/aesdsocketdata");
-#endif
-
-        pthread_mutex_destroy(&file_options.file_mutex);
-
-        while (!TAILQ_EMPTY(&thread_list_head)) {
-            thread_list_entry = TAILQ_FIRST(&thread_list_head);
-            TAILQ_REMOVE(&thread_list_head, thread_list_entry, threads);
-            pthread_join(thread_list_entry->thread_id, NULL);
-            free(thread_list_entry);
-        }
-
-        exit(0);
+struct connection_ring connection_ring;
+connections_t connections = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .active = 0,
+};
+
+int setup_signal_handler() {
+    sigset_t mask;
+    int signal_fd;
+
+    // Block the termination signals in every thread and receive them through a
+    // signalfd polled by the event loop, so shutdown never runs in signal context
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        perror("pthread_sigmask");
+        exit(-1);
     }
-}
-
-void setup_signal_handler() {
-    struct sigaction sa;
-    sa.sa_handler = handle_signal;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
 
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        perror("sigaction");
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
         exit(-1);
     }
 
-    if (sigaction(SIGTERM, &sa, NULL) == -1) {
-        perror("sigaction");
+    return signal_fd;
+}
+
+/**
+ * Parse the decimal argument of an option, exiting with a message naming the
+ * option unless it is all digits and between min and max
+ */
+static unsigned long parse_number(const char *arg, unsigned long min, unsigned long max, const char *name) {
+    unsigned long value;
+    char *end;
+
+    errno = 0;
+    value = strtoul(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || *end != '\0' || errno == ERANGE || value < min || value > max) {
+        fprintf(stderr, "Invalid %s: %s\n", name, arg);
         exit(-1);
     }
+
+    return value;
 }
 
 void parse_command_line_options(int argc, char *argv[], aesdsocket_options_t *options) {
-    int opt;
+    int opt, level;
     options->daemon_mode = 0;
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    options->timestamp_interval_ms = TIMESTAMP_INTERVAL_MS;
+    options->drain_timeout_ms = DRAIN_TIMEOUT_MS;
+    options->hot_restart = 0;
+    options->metrics_port = METRICS_PORT;
+    options->max_connections = CONNECTIONS_MAX;
+    options->packet_rate = 0;
+    options->byte_rate = 0;
+    options->host_packet_rate = 0;
+    options->host_byte_rate = 0;
+    options->unix_path = NULL;
+    options->huge_pages = 0;
+    while ((opt = getopt(argc, argv, "drt:D:M:l:c:p:b:P:B:u:H")) != -1) {
         switch (opt) {
             case 'd':
                 options->daemon_mode = 1;
                 break;
+            case 'r':
+                options->hot_restart = 1;
+                break;
+            case 't':
+                options->timestamp_interval_ms = parse_number(optarg, 1, ULONG_MAX, "timestamp interval");
+                break;
+            case 'D':
+                options->drain_timeout_ms = parse_number(optarg, 0, ULONG_MAX, "drain timeout");
+                break;
+            case 'M':
+                // 0 turns the metrics endpoint off
+                options->metrics_port = parse_number(optarg, 0, USHRT_MAX, "metrics port");
+                break;
+            case 'l':
+                level = log_parse_level(optarg);
+                if (level < 0) {
+                    fprintf(stderr, "Invalid log level: %s\n", optarg);
+                    exit(-1);
+                }
+                log_set_level(level);
+                break;
+            case 'c':
+                options->max_connections = parse_number(optarg, 1, CONNECTIONS_LIMIT, "connection limit");
+                break;
+            case 'p':
+                options->packet_rate = parse_number(optarg, 0, ULONG_MAX, "packet rate");
+                break;
+            case 'b':
+                options->byte_rate = parse_number(optarg, 0, ULONG_MAX, "byte rate");
+                break;
+            case 'P':
+                options->host_packet_rate = parse_number(optarg, 0, ULONG_MAX, "packet rate per address");
+                break;
+            case 'B':
+                options->host_byte_rate = parse_number(optarg, 0, ULONG_MAX, "byte rate per address");
+                break;
+            case 'u':
+                options->unix_path = optarg;
+                break;
+            case 'H':
+                options->huge_pages = 1;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-d] [-r] [-t timestamp_interval_ms] [-D drain_timeout_ms] [-M metrics_port] [-l log_level]"
+                                " [-c max_connections] [-p packets_per_s] [-b bytes_per_s]"
+                                " [-P packets_per_s_per_address] [-B bytes_per_s_per_address] [-u unix_socket_path] [-H]\n", argv[0]);
                 exit(-1);
         }
     }
 }
 
-void timestamp() {
-    char buffer[BUFFER_SIZE];
-    time_t rawtime;
-    struct tm *timeinfo;
-    int file_fd;
-
-    // Open the file /var/tmp/aesdsocketdata for read/write
-    file_fd = open(AESD_CHAR_DEVICE_PATH, O_RDWR | O_CREAT, 0644);
-    if (file_fd < 0) {
-        perror("open failed");
-        exit(-1);
-    }
-
-    while (1) {
-        // Acquire the mutex before accessing the file
-        if (pthread_mutex_lock(&file_options.file_mutex)) {
-            perror("pthread_mutex_lock");
-            exit(-1);
-        }
-
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
-        strftime(buffer, BUFFER_SIZE, "timestamp:%Y-%m-%d %H:%M:%S\n", timeinfo);
-
-        // Move the file pointer to the end of the file
-        lseek(file_fd, 0, SEEK_END);
-
-        write(file_fd, buffer, strlen(buffer));
-        
-        // Release the mutex after accessing the file
-        if (pthread_mutex_unlock(&file_options.file_mutex)) {
-            perror("pthread_mutex_unlock");
-            exit(-1);
-        }
-
-        sleep(10);
-    }
-}
+// Everything a connection allocates from its arena has to fit, with the arena header
+// and up to a cache line of padding after each allocation
+_Static_assert(4 * POOL_ALIGN + sizeof(socket_options_t) + BUFFER_SIZE + sizeof(binary_conn_t) <= POOL_ARENA_SIZE,
+               "connection buffers do not fit in a pool arena");
 
 void handle_socket(void *arguments) {
-    char buffer[BUFFER_SIZE];  // Allocate a thread-specific buffer
-    int valread, file_fd;
+    char *buffer;
+    int valread;
+    ssize_t sent;
     struct aesd_seekto seekto;
+    store_handle_t handle;
+    int subscribed = 0;
+    int binary_mode = 0;
+    binary_conn_t *binary;
+    query_t query;
+    query_result_t matches = { 0 };
+    limit_t limit;
+    uint64_t delay_ns, host_delay_ns;
     socket_options_t *socket = (socket_options_t *)arguments;
 
-    // Open the file /var/tmp/aesdsocketdata for read/write
-    file_fd = open(AESD_CHAR_DEVICE_PATH, O_RDWR | O_CREAT, 0644);
-    if (file_fd < 0) {
-        perror("open failed");
-        exit(-1);
+    if (metrics_thread_register() < 0) {
+        AESD_LOG(LOG_ERR, "metrics_thread_register: %m");
     }
 
-    memset(buffer, 0, BUFFER_SIZE);
+    // Open the store for read/write
+    if (store_handle_open(&handle) < 0) {
+        AESD_LOG(LOG_ERR, "open failed: %m");
+        goto out;
+    }
 
-    // Reading data from the client
-    while ((valread = read(socket->socket_fd, buffer, BUFFER_SIZE)) > 0) {
+    // The buffers come from the connection's arena, only what was read is ever looked at
+    buffer = arena_alloc(socket->arena, BUFFER_SIZE);
+    binary = arena_alloc(socket->arena, sizeof(binary_conn_t));
+    limit_init(&limit, options.packet_rate, options.byte_rate);
+    binary_init(binary);
+
+    // Reading data from the client, leaving room for the terminating null used by sscanf
+    while ((valread = read(socket->socket_fd, buffer, BUFFER_SIZE - 1)) > 0) {
+        buffer[valread] = '\0';
+        METRICS_ADD(packets, 1);
+        METRICS_ADD(bytes_in, valread);
+
+        // Hold the packet back while this connection or its address is over its rate,
+        // meanwhile the client's further data waits in the socket buffers
+        delay_ns = limit_take(&limit, valread);
+        if (socket->host) {
+            host_delay_ns = limit_host_take(socket->host, valread);
+            if (host_delay_ns > delay_ns) {
+                delay_ns = host_delay_ns;
+            }
+        }
+        if (delay_ns) {
+            METRICS_ADD(throttled_ns, delay_ns);
+            limit_wait(socket->socket_fd, delay_ns);
+        }
 
-        // Acquire the mutex before accessing the file
-        if (pthread_mutex_lock(&file_options.file_mutex)) {
-            perror("pthread_mutex_lock");
-            exit(-1);
+        // Binary requests carry their own framing, nothing is scanned for text commands
+        if (binary_mode) {
+            if (binary_receive(binary, &handle, socket->socket_fd, buffer, valread) < 0) {
+                AESD_LOG(LOG_WARNING, "binary_receive: %m");
+                // Let the client see the end right away rather than once the thread is reaped
+                shutdown(socket->socket_fd, SHUT_RDWR);
+                break;
+            }
+            continue;
         }
 
         // Check if the buffer contains the ioctl command
         // If so, send the IOCTL command and read back from current file position
         if (sscanf(buffer, "AESDCHAR_IOCSEEKTO:%d,%d", &seekto.write_cmd, &seekto.write_cmd_offset) == 2) {
             // Perform the ioctl operation
-            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-                perror("ioctl");
+            if (store_seekto(&handle, &seekto) == -1) {
+                AESD_LOG(LOG_WARNING, "ioctl: %m");
             }
         }
-        // If no IOCTL command, then append to the end of the file and read back entire file
-        else {  
-            // Move the file pointer to the end of the file
-            lseek(file_fd, 0, SEEK_END);
-
-            // Writing data to the file
-            write(file_fd, buffer, strlen(buffer));
+        // Reply mode and resync requests are not stored
+        else if (strncmp(buffer, CMD_MODE_DELTA, strlen(CMD_MODE_DELTA)) == 0) {
+            store_set_delta(&handle, 1);
+        }
+        else if (strncmp(buffer, CMD_MODE_FULL, strlen(CMD_MODE_FULL)) == 0) {
+            store_set_delta(&handle, 0);
+        }
+        else if (strncmp(buffer, CMD_RESYNC, strlen(CMD_RESYNC)) == 0) {
+            store_resync(&handle);
+        }
+        // A subscriber is served by the fan-out thread, this thread is done with it
+        else if (strncmp(buffer, CMD_SUBSCRIBE, strlen(CMD_SUBSCRIBE)) == 0) {
+            if (subscribe_add(socket->socket_fd) == 0) {
+                subscribed = 1;
+                break;
+            }
+            AESD_LOG(LOG_ERR, "subscribe_add: %m");
+        }
+        // Whatever followed the command in the same packet is already binary
+        else if (strncmp(buffer, CMD_MODE_BINARY, strlen(CMD_MODE_BINARY)) == 0) {
+            binary_mode = 1;
+            if (binary_receive(binary, &handle, socket->socket_fd, buffer + strlen(CMD_MODE_BINARY),
+                               valread - strlen(CMD_MODE_BINARY)) < 0) {
+                AESD_LOG(LOG_WARNING, "binary_receive: %m");
+                shutdown(socket->socket_fd, SHUT_RDWR);
+                break;
+            }
+            continue;
+        }
+        // A query is answered with the matching commands instead of the store contents
+        else if (strncmp(buffer, CMD_QUERY, strlen(CMD_QUERY)) == 0 ||
+                 strncmp(buffer, CMD_QUERY_RANGE, strlen(CMD_QUERY_RANGE)) == 0) {
+            if (query_parse(buffer, valread, &query) < 0) {
+                AESD_LOG(LOG_WARNING, "Malformed query range");
+            } else {
+                sent = query_reply(socket->socket_fd, &query, &matches);
+                if (sent > 0) {
+                    METRICS_ADD(bytes_out, sent);
+                }
+            }
+            continue;
+        }
+        // If no IOCTL command, then append to the end of the store and read back the entire store
+        else {
+            if (store_append(&handle, buffer, valread) < 0) {
+                AESD_LOG(LOG_ERR, "store_append: %m");
+            }
+            subscribe_notify();
+        }
 
-            // Rewind the file pointer to the beginning
-            lseek(file_fd, 0, SEEK_SET);
+        // Sending the store contents to the client
+        sent = store_reply(&handle, socket->socket_fd);
+        if (sent > 0) {
+            METRICS_ADD(bytes_out, sent);
         }
-        
-        // Clear the buffer
-        memset(buffer, 0, BUFFER_SIZE);
-        
-        // Reading data from the file
-        read(file_fd, buffer, BUFFER_SIZE);
+    }
 
-        // Sending buffer to the client
-        send(socket->socket_fd, buffer, strlen(buffer), 0);
+    if (subscribed) {
+        AESD_LOG(LOG_INFO, "Client subscribed");
+    } else {
+        AESD_LOG(LOG_INFO, "Client disconnected");
+    }
 
-        printf("Data sent to client: %s\n", buffer);
+    // Close the store, the socket is closed by the main thread once this thread is joined
+    binary_cleanup(binary);
+    query_result_free(&matches);
+    store_handle_close(&handle);
+
+out:
+    /*
+     * The main thread may not reap this connection until its poll() next wakes up, so
+     * end it now, letting the client see end of file right away. The descriptor stays
+     * open, and its number taken, until the reap. A subscriber's duplicate shares the
+     * connection, which the fan-out thread now serves.
+     */
+    if (!subscribed) {
+        shutdown(socket->socket_fd, SHUT_RDWR);
+    }
 
-        // Release the mutex after accessing the file
-        if (pthread_mutex_unlock(&file_options.file_mutex)) {
-            perror("pthread_mutex_unlock");
-            exit(-1);
+    limit_host_put(socket->host);
+    METRICS_ADD(disconnections, 1);
+    metrics_thread_unregister();
+    log_thread_exit();
+
+    // Let the main thread know this connection can be reaped
+    pthread_mutex_lock(&connections.lock);
+    atomic_store(&socket->done, 1);
+    connections.active--;
+    pthread_cond_signal(&connections.cond);
+    pthread_mutex_unlock(&connections.lock);
+
+    pthread_exit(NULL);
+}
+
+// Join connection threads that have finished, or all of them when wait_all is set
+void reap_connections(int wait_all) {
+    connection_t connection;
+    size_t count;
+
+    // Rotate through the ring once, putting back the connections still running
+    count = connection_ring_count(&connection_ring);
+    while (count--) {
+        connection_ring_pop(&connection_ring, &connection);
+
+        if (wait_all || atomic_load(&connection.socket->done)) {
+            pthread_join(connection.thread_id, NULL);
+            close(connection.socket->socket_fd);
+            pool_put(connection.socket->arena);
+        } else {
+            connection_ring_push(&connection_ring, &connection, NULL);
         }
+    }
+}
 
-        // Clear the buffer for the next iteration
-        memset(buffer, 0, BUFFER_SIZE);
+// Give in-flight connections until the drain timeout to finish, then force them closed
+void drain_connections(unsigned long timeout_ms) {
+    connection_t *connection;
+    struct timespec deadline;
+    size_t index;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
     }
 
-    printf("Client disconnected\n");
-    syslog(LOG_INFO, "Client disconnected");
+    pthread_mutex_lock(&connections.lock);
+    while (connections.active > 0) {
+        if (pthread_cond_timedwait(&connections.cond, &connections.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&connections.lock);
 
-    // Close the socket and free the memory
-    close(socket->socket_fd);
-    close(file_fd);
-    free(socket);
-    socket = NULL;
+    // Shutting down the socket wakes threads blocked in read() or send()
+    AESD_RING_FOREACH(connection_ring, &connection_ring, index, connection) {
+        if (!atomic_load(&connection->socket->done)) {
+            shutdown(connection->socket->socket_fd, SHUT_RDWR);
+        }
+    }
 
-    pthread_exit(NULL);
+    reap_connections(1);
 }
 
-void aesdsocket_create_socket() {
-    int server_fd, accept_fd;
-    socket_options_t *new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    thread_list_t *thread_list_entry;
-    pthread_t thread_id;
+// Bind port 9000 for family, AF_INET or AF_INET6, -1 on failure
+int aesdsocket_bind_socket(int family) {
+    int server_fd;
+    struct sockaddr_storage address;
+    struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+    struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&address;
+    socklen_t length;
 
     // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(-1);
+    if ((server_fd = socket(family, SOCK_STREAM, 0)) < 0) {
+        return -1;
     }
 
     // Forcefully attaching socket to the port 9000
     int opt = 1;
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt");
         close(server_fd);
-        exit(-1);
+        return -1;
     }
 
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
         close(server_fd);
-        exit(-1);
+        return -1;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    memset(&address, 0, sizeof(address));
+    if (family == AF_INET6) {
+        // IPv4 clients go to the IPv4 listener, which could not bind the port otherwise
+        if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt))) {
+            close(server_fd);
+            return -1;
+        }
+        address6->sin6_family = AF_INET6;
+        address6->sin6_addr = in6addr_any;
+        address6->sin6_port = htons(PORT);
+        length = sizeof(struct sockaddr_in6);
+    } else {
+        address4->sin_family = AF_INET;
+        address4->sin_addr.s_addr = INADDR_ANY;
+        address4->sin_port = htons(PORT);
+        length = sizeof(struct sockaddr_in);
+    }
 
     // Binding the socket to the port 9000
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
+    if (bind(server_fd, (struct sockaddr *)&address, length) < 0) {
         close(server_fd);
-        exit(-1);
+        return -1;
     }
 
+    return server_fd;
+}
+
+/**
+ * Remove a socket left at the address by an instance that did not exit cleanly.
+ * Only a socket refusing connections is removed. Anything else fails, with
+ * EEXIST for something that is not a socket and EADDRINUSE for a socket that
+ * is still being served.
+ */
+int aesdsocket_remove_stale_socket(const struct sockaddr_un *address) {
+    struct stat st;
+    int probe_fd, rc, error;
+
+    if (lstat(address->sun_path, &st) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    // Non-blocking, so a listener with a full backlog counts as in use rather than blocking
+    probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe_fd < 0) {
+        return -1;
+    }
+    rc = connect(probe_fd, (const struct sockaddr *)address, sizeof(*address));
+    error = errno;
+    close(probe_fd);
+
+    if (rc == 0 || error == EAGAIN) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (error != ECONNREFUSED) {
+        errno = error;
+        return -1;
+    }
+
+    return unlink(address->sun_path);
+}
+
+// Bind a Unix stream socket at path, -1 on failure
+int aesdsocket_bind_unix(const char *path) {
+    struct sockaddr_un address;
+    int server_fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((server_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if (aesdsocket_remove_stale_socket(&address) < 0 ||
+        bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+/**
+ * Put the listening sockets handed over by the previous instance in their slots,
+ * closing any this instance does not listen on, such as a different Unix socket path
+ */
+void aesdsocket_adopt_listeners(const int *server_fds, int count, int *listeners) {
+    struct sockaddr_storage address;
+    socklen_t length;
+    int i, slot;
+
+    for (i = 0; i < count; i++) {
+        slot = -1;
+        length = sizeof(address);
+        if (getsockname(server_fds[i], (struct sockaddr *)&address, &length) == 0) {
+            if (address.ss_family == AF_INET) {
+                slot = LISTENER_INET;
+            } else if (address.ss_family == AF_INET6) {
+                slot = LISTENER_INET6;
+            } else if (address.ss_family == AF_UNIX && options.unix_path != NULL &&
+                       strncmp(((struct sockaddr_un *)&address)->sun_path, options.unix_path,
+                               sizeof(((struct sockaddr_un *)&address)->sun_path)) == 0) {
+                slot = LISTENER_UNIX;
+            }
+        }
+
+        if (slot < 0 || listeners[slot] >= 0) {
+            close(server_fds[i]);
+            continue;
+        }
+        listeners[slot] = server_fds[i];
+    }
+}
+
+// Bind the listeners that were not handed over, exiting if a required one fails
+void aesdsocket_bind_listeners(int *listeners) {
+    if (listeners[LISTENER_INET] < 0) {
+        listeners[LISTENER_INET] = aesdsocket_bind_socket(AF_INET);
+        if (listeners[LISTENER_INET] < 0) {
+            perror("bind failed");
+            exit(-1);
+        }
+    }
+
+    // Not every host has IPv6, the server works without it
+    if (listeners[LISTENER_INET6] < 0) {
+        listeners[LISTENER_INET6] = aesdsocket_bind_socket(AF_INET6);
+        if (listeners[LISTENER_INET6] < 0) {
+            AESD_LOG(LOG_WARNING, "Not listening on IPv6: %m");
+        }
+    }
+
+    if (options.unix_path != NULL && listeners[LISTENER_UNIX] < 0) {
+        listeners[LISTENER_UNIX] = aesdsocket_bind_unix(options.unix_path);
+        if (listeners[LISTENER_UNIX] < 0) {
+            perror("bind unix socket failed");
+            exit(-1);
+        }
+    }
+}
+
+// Close the listeners, removing the Unix socket path unless the socket was handed over
+void aesdsocket_close_listeners(int *listeners, int handed_off) {
+    int i;
+
+    if (listeners[LISTENER_UNIX] >= 0 && !handed_off) {
+        unlink(options.unix_path);
+    }
+
+    for (i = 0; i < LISTENER_COUNT; i++) {
+        if (listeners[i] >= 0) {
+            close(listeners[i]);
+            listeners[i] = -1;
+        }
+    }
+}
+
+/**
+ * Accept a connection on server_fd and start its thread
+ * @return -1 if the listener failed and the server should stop
+ */
+int aesdsocket_accept(int server_fd) {
+    struct sockaddr_storage address;
+    socklen_t addrlen = sizeof(address);
+    char client_address[INET6_ADDRSTRLEN];
+    socket_options_t *new_socket;
+    connection_t connection;
+    arena_t *arena;
+    int accept_fd, rc;
+
+    // Accepting incoming connection
+    accept_fd = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+    if (accept_fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+            return 0;
+        }
+        AESD_LOG(LOG_ERR, "accept: %m");
+        return -1;
+    }
+
+    // Log the accept message, formatting the address only when the level is enabled
+    if (LOG_INFO <= atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        if (address.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&address)->sin_addr, client_address, sizeof(client_address));
+        } else if (address.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&address)->sin6_addr, client_address, sizeof(client_address));
+        } else {
+            strcpy(client_address, "local socket");
+        }
+        log_message(LOG_INFO, "Accepted connection from %s", client_address);
+    }
+
+    // Admission control, before any resources are spent on the connection
+    if (connection_ring_full(&connection_ring)) {
+        AESD_LOG(LOG_WARNING, "Too many connections, refusing a new one");
+        METRICS_ADD(connections_refused, 1);
+        close(accept_fd);
+        return 0;
+    }
+
+    // The socket_options_t passed to the thread is the first thing in the connection's arena
+    arena = pool_get();
+    if (arena == NULL) {
+        AESD_LOG(LOG_ERR, "No buffers left in the pool, refusing a connection");
+        METRICS_ADD(connections_refused, 1);
+        close(accept_fd);
+        return 0;
+    }
+    new_socket = arena_alloc(arena, sizeof(socket_options_t));
+    new_socket->arena = arena;
+    new_socket->socket_fd = accept_fd;
+    atomic_init(&new_socket->done, 0);
+    // Unix socket clients have no address, per address limits do not apply to them
+    new_socket->host = limit_host_get((struct sockaddr *)&address);
+
+    pthread_mutex_lock(&connections.lock);
+    connections.active++;
+    pthread_mutex_unlock(&connections.lock);
+
+    // Only admitted connections are counted, refused ones have a counter of their own.
+    // Counted before the thread starts, so its disconnection is never seen first.
+    METRICS_ADD(connections, 1);
+
+    // Create a new thread to handle the socket
+    rc = pthread_create(&connection.thread_id, NULL, (void *)handle_socket, (void *)new_socket);
+    if (rc != 0) {
+        // pthread_create returns the error rather than setting errno
+        AESD_LOG(LOG_ERR, "pthread_create: %s", strerror(rc));
+        METRICS_ADD(disconnections, 1);
+        pthread_mutex_lock(&connections.lock);
+        connections.active--;
+        pthread_mutex_unlock(&connections.lock);
+        limit_host_put(new_socket->host);
+        pool_put(arena);
+        close(accept_fd);
+        return 0;
+    }
+
+    connection.socket = new_socket;
+    connection_ring_push(&connection_ring, &connection, NULL);
+
+    return 0;
+}
+
+// Milliseconds for poll to wait until deadline_ns, rounded up, -1 for no deadline
+static int poll_timeout_ms(uint64_t deadline_ns) {
+    uint64_t now_ns;
+
+    if (deadline_ns == 0) {
+        return -1;
+    }
+    now_ns = metrics_now_ns();
+    if (now_ns >= deadline_ns) {
+        return 0;
+    }
+
+    return (deadline_ns - now_ns + 999999) / 1000000;
+}
+
+void aesdsocket_create_socket(int signal_fd) {
+    int listeners[LISTENER_COUNT], handed_fds[CONTROL_MAX_FDS];
+    int timer_fd = -1, control_fd, metrics_fd = -1, handoff_fd = -1;
+    control_client_t control_client = { .fd = -1 };
+    metrics_client_t metrics_client = { .fd = -1 };
+    uint64_t deadline_ns;
+    struct pollfd fds[POLL_FD_COUNT];
+    nfds_t nfds = POLL_FD_TIMER;
+    struct signalfd_siginfo siginfo;
+    int running = 1;
+    int count, i;
+
+    for (i = 0; i < LISTENER_COUNT; i++) {
+        listeners[i] = -1;
+    }
+
+    // Take over the listening sockets of a running instance, binding any it did not have
+    if (options.hot_restart) {
+        count = control_request_handoff(handed_fds, CONTROL_MAX_FDS, &handoff_fd);
+        if (count < 0) {
+            AESD_LOG(LOG_INFO, "No running instance to take over from, binding port %d", PORT);
+        } else {
+            aesdsocket_adopt_listeners(handed_fds, count, listeners);
+        }
+    }
+    aesdsocket_bind_listeners(listeners);
+
     // Create a daemon if the daemon_mode is set
     if (options.daemon_mode) {
         daemon(0, 0);
     }
 
+    // Started after daemon() so the log thread runs in the daemon process
+    if (log_init(!options.daemon_mode) < 0) {
+        perror("log_init");
+    }
+
+    // New connections wait in the listen backlog while the previous instance
+    // drains, so the store is only opened once it is no longer being written
+    if (handoff_fd >= 0) {
+        control_wait_handoff(handoff_fd);
+        handoff_fd = -1;
+        AESD_LOG(LOG_INFO, "Took over listening sockets from previous instance");
+    }
+
+    // Initialize the store shared by all connections
+    if (store_init() != 0) {
+        perror("store_init");
+        aesdsocket_close_listeners(listeners, 0);
+        closelog();
+        exit(-1);
+    }
+
+    // One arena for each connection that can be open at once
+    if (pool_init(options.max_connections, options.huge_pages) < 0) {
+        perror("pool_init");
+        store_cleanup(0);
+        aesdsocket_close_listeners(listeners, 0);
+        closelog();
+        exit(-1);
+    }
+
+    // Without the fan-out thread the server still runs, subscribe requests just fail
+    if (subscribe_init() < 0) {
+        perror("subscribe_init");
+    }
+
+    // Without a control socket the server still runs, it just can't be hot restarted
+    control_fd = control_socket_create();
+    if (control_fd < 0) {
+        perror("control_socket_create");
+    }
+
+    // The main thread accounts accepted connections
+    if (metrics_thread_register() < 0) {
+        perror("metrics_thread_register");
+    }
+    if (options.metrics_port) {
+        metrics_fd = metrics_socket_create(options.metrics_port);
+        if (metrics_fd < 0) {
+            perror("metrics_socket_create");
+        }
+    }
+
 #if USE_AESD_CHAR_DEVICE != 1
-    // Create a thread to write the timestamp to the file
-    if (pthread_create(&thread_id, NULL, (void *)timestamp, NULL) < 0) {
-        perror("pthread_create");
-        close(file_options.file_fd);
+    // The event loop formats a timestamp each time the timer fires, a writer thread appends it
+    timer_fd = timestamp_timer_create(options.timestamp_interval_ms);
+    if (timer_fd < 0 || timestamp_init() < 0) {
+        perror("timestamp_init");
+        aesdsocket_close_listeners(listeners, 0);
+        store_cleanup(1);
         closelog();
         exit(-1);
     }
 #endif
      
     // Listening for incoming connections
-    if (listen(server_fd, 3) < 0) {
-        perror("listen");
-        close(server_fd);
-        exit(-1);
+    for (i = 0; i < LISTENER_COUNT; i++) {
+        if (listeners[i] >= 0 && listen(listeners[i], SOMAXCONN) < 0) {
+            perror("listen");
+            aesdsocket_close_listeners(listeners, 0);
+            exit(-1);
+        }
+        fds[POLL_FD_LISTENER + i].fd = listeners[i];
+        fds[POLL_FD_LISTENER + i].events = POLLIN;
     }
 
-    printf("Server listening on port %d\n", PORT);
-    syslog(LOG_INFO, "Server listening on port %d", PORT);
+    AESD_LOG(LOG_INFO, "Server listening on port %d", PORT);
+    if (listeners[LISTENER_UNIX] >= 0) {
+        AESD_LOG(LOG_INFO, "Server listening on %s", options.unix_path);
+    }
 
-    // Accepting incoming connection
-    while ((accept_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) > 0) {
+    fds[POLL_FD_SIGNAL].fd = signal_fd;
+    fds[POLL_FD_SIGNAL].events = POLLIN;
+    fds[POLL_FD_CONTROL].events = POLLIN;
+    fds[POLL_FD_CONTROL_CLIENT].events = POLLIN;
+    fds[POLL_FD_METRICS].events = POLLIN;
+    if (timer_fd >= 0) {
+        fds[POLL_FD_TIMER].fd = timer_fd;
+        fds[POLL_FD_TIMER].events = POLLIN;
+        nfds = POLL_FD_COUNT;
+    }
+
+    // Event loop accepting incoming connections, writing timestamps and handling signals
+    while (running) {
+        // Control and metrics clients are served one at a time, others wait in the backlog
+        fds[POLL_FD_CONTROL].fd = control_client.fd < 0 ? control_fd : -1;
+        fds[POLL_FD_CONTROL_CLIENT].fd = control_client.fd;
+        fds[POLL_FD_METRICS].fd = metrics_client.fd < 0 ? metrics_fd : -1;
+        fds[POLL_FD_METRICS_CLIENT].fd = metrics_client.fd;
+        fds[POLL_FD_METRICS_CLIENT].events = metrics_client.events;
+
+        // Wake up for whichever client is dropped first
+        deadline_ns = control_client.fd >= 0 ? control_client.deadline_ns : 0;
+        if (metrics_client.fd >= 0 && (deadline_ns == 0 || metrics_client.deadline_ns < deadline_ns)) {
+            deadline_ns = metrics_client.deadline_ns;
+        }
 
-        // Log the accept message to syslog
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(address.sin_addr));
-        printf("Accepted connection from %s\n", inet_ntoa(address.sin_addr));
+        if (poll(fds, nfds, poll_timeout_ms(deadline_ns)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "poll: %m");
+            break;
+        }
 
-        // Create a new socket_options_t struct to pass to the thread
-        new_socket = malloc(sizeof(socket_options_t));
-        new_socket->socket_fd = accept_fd;
+        // Join the threads of connections closed since the last event
+        reap_connections(0);
 
-        // Create a new thread to handle the socket
-        if (pthread_create(&thread_id, NULL, (void *)handle_socket, (void *)new_socket) < 0) {
-            perror("pthread_create");
-            close(accept_fd);
-            close(server_fd);
-            closelog();
-            exit(-1);
+        if (fds[POLL_FD_SIGNAL].revents & POLLIN) {
+            if (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+                AESD_LOG(LOG_INFO, "Caught signal %d, exiting", siginfo.ssi_signo);
+                running = 0;
+                continue;
+            }
         }
 
-        // Create a new thread_list_entry
-        thread_list_entry = (thread_list_t *)malloc(sizeof(thread_list_t));
-        if (thread_list_entry == NULL) {
-            perror("malloc");
-            close(accept_fd);
-            close(server_fd);
-            closelog();
-            exit(-1);
+        if (fds[POLL_FD_CONTROL_CLIENT].revents) {
+            if (control_handle_client(&control_client, listeners, LISTENER_COUNT, &handoff_fd) == CONTROL_HANDOFF) {
+                running = 0;
+                continue;
+            }
+        }
+        control_client_expire(&control_client, metrics_now_ns());
+
+        if (fds[POLL_FD_CONTROL].revents & POLLIN) {
+            control_accept(control_fd, &control_client);
+        }
+
+        if (fds[POLL_FD_METRICS_CLIENT].revents) {
+            metrics_handle_client(&metrics_client);
+        }
+        metrics_client_expire(&metrics_client, metrics_now_ns());
+
+        if (fds[POLL_FD_METRICS].revents & POLLIN) {
+            metrics_accept(metrics_fd, &metrics_client);
+        }
+
+        if (nfds > POLL_FD_TIMER && (fds[POLL_FD_TIMER].revents & POLLIN)) {
+            timestamp(timer_fd);
+        }
+
+        for (i = 0; i < LISTENER_COUNT; i++) {
+            if ((fds[POLL_FD_LISTENER + i].revents & POLLIN) && aesdsocket_accept(listeners[i]) < 0) {
+                running = 0;
+            }
         }
-        thread_list_entry->thread_id = thread_id;
-        TAILQ_INSERT_TAIL(&thread_list_head, thread_list_entry, threads);
     }
-    
-    // It is possible that the accept call failed, so close the server socket and exit
-    perror("accept");
-    
-    // Closing the socket
-    close(accept_fd);
-    close(server_fd);
-    closelog();
 
-#if USE_AESD_CHAR_DEVICE != 1
-    system("rm -f /var/tmp/aesdsocketdata");
-#endif
+    // Stop accepting new connections and timestamps before draining the existing ones
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    control_client_close(&control_client);
+    control_socket_close(control_fd);
+    metrics_client_close(&metrics_client);
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+    }
+    aesdsocket_close_listeners(listeners, handoff_fd >= 0);
+
+    drain_connections(options.drain_timeout_ms);
+    timestamp_shutdown();
+    subscribe_shutdown();
+
+    // After a handoff the new instance carries on with the same store
+    store_flush();
+    store_cleanup(handoff_fd < 0);
+    pool_cleanup();
+
+    // Closing the handoff connection tells the new instance this one is gone
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+    }
+    close(signal_fd);
+    log_shutdown();
+    closelog();
 
     exit(0);
 }
 
 int main(int argc, char *argv[]) {
+    connection_t *connection_storage;
+    int signal_fd;
 
     parse_command_line_options(argc, argv, &options);
 
-    TAILQ_INIT(&thread_list_head);
+    connection_storage = calloc(options.max_connections, sizeof(connection_t));
+    if (connection_storage == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    connection_ring_init(&connection_ring, connection_storage, options.max_connections);
+    limit_hosts_configure(options.host_packet_rate, options.host_byte_rate);
 
-    setup_signal_handler();
+    // Set up before any thread is created so every thread inherits the blocked signal mask
+    signal_fd = setup_signal_handler();
 
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
 
-    // Initialize the mutex
-    if (pthread_mutex_init(&file_options.file_mutex, NULL) != 0) {
-        perror("pthread_mutex_init");
-        closelog();
-        exit(-1);
-    }
-
     // Run sockets in the main thread
-    aesdsocket_create_socket(&options);
+    aesdsocket_create_socket(signal_fd);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,8 +1,81 @@
 #ifndef AESDSOCKET_H
 #define AESDSOCKET_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+
+#include "aesd-ring.h"
+#include "aesdsocket-limit.h"
+#include "aesdsocket-pool.h"
+#include "aesdsocket-timestamp.h"
+
 #define PORT 9000
 #define BUFFER_SIZE 32768
+// Default time given to open connections to finish on shutdown, overridden with -D
+#define DRAIN_TIMEOUT_MS 2000
+/*
+ * Commands a client can send instead of data. In delta mode each reply only carries
+ * what was added to the store since the previous reply to that connection, after a
+ * first reply with the entire store. A resync sends the entire store again.
+ */
+#define CMD_MODE_DELTA "AESDSOCKET_MODE:DELTA\n"
+#define CMD_MODE_FULL "AESDSOCKET_MODE:FULL\n"
+#define CMD_RESYNC "AESDSOCKET_RESYNC\n"
+/*
+ * Turns the connection into a subscriber: from then on it is sent whatever is
+ * appended to the store, without sending anything itself. Input is ignored.
+ */
+#define CMD_SUBSCRIBE "AESDSOCKET_SUBSCRIBE\n"
+/*
+ * Switches the connection to length-prefixed binary requests and responses, see
+ * aesdsocket-binary.h. Nothing is sent back for the command itself.
+ */
+#define CMD_MODE_BINARY "AESDSOCKET_MODE:BINARY\n"
+/*
+ * Reply with only the stored commands containing a pattern instead of the entire
+ * store, see aesdsocket-query.h. Commands are numbered from 0 for the oldest one
+ * stored, as with AESDCHAR_IOCSEEKTO, and the range form only searches first to
+ * last inclusive:
+ *   AESDSOCKET_QUERY:<pattern>\n
+ *   AESDSOCKET_QUERY_RANGE:<first>,<last>:<pattern>\n
+ * An empty pattern matches every command. The reply position and delta mode of the
+ * connection are left as they were.
+ */
+#define CMD_QUERY "AESDSOCKET_QUERY:"
+#define CMD_QUERY_RANGE "AESDSOCKET_QUERY_RANGE:"
+
+// Default for the connections open at once, further ones are refused until some
+// have finished. Overridden with -c.
+#define CONNECTIONS_MAX 1024
+// Largest -c accepted. Each connection reserves an arena of the buffer pool and
+// a slot in the connection ring up front, so this keeps those sizes sane.
+#define CONNECTIONS_LIMIT 65536
+
+/*
+ * Listening sockets, all accepted the same way. IPv4 is always bound, IPv6 when
+ * the host has it, IPv6 only so the two together make a dual-stack server, and
+ * the Unix socket when a path is given with -u.
+ */
+enum {
+    LISTENER_INET,
+    LISTENER_INET6,
+    LISTENER_UNIX,
+    LISTENER_COUNT,
+};
+
+// Slots in the event loop poll set, the timer is only polled with the file store.
+// Sockets that are not open have their fd set to -1, which poll skips.
+enum {
+    POLL_FD_SIGNAL,
+    POLL_FD_CONTROL,
+    POLL_FD_CONTROL_CLIENT,
+    POLL_FD_METRICS,
+    POLL_FD_METRICS_CLIENT,
+    POLL_FD_LISTENER,
+    POLL_FD_TIMER = POLL_FD_LISTENER + LISTENER_COUNT,
+    POLL_FD_COUNT,
+};
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -16,21 +89,41 @@
 
 typedef struct {
     int daemon_mode;
+    unsigned long timestamp_interval_ms;
+    unsigned long drain_timeout_ms;
+    int hot_restart;
+    unsigned short metrics_port;
+    size_t max_connections;
+    // Rate limits per connection (-p, -b) and per source address (-P, -B), 0 for none
+    unsigned long packet_rate;
+    unsigned long byte_rate;
+    unsigned long host_packet_rate;
+    unsigned long host_byte_rate;
+    const char *unix_path;  // Path of the Unix socket listener, NULL for none
+    int huge_pages;         // Back the connection buffer pool with huge pages
 } aesdsocket_options_t;
 
 typedef struct {
     int socket_fd;
+    atomic_int done;  // Set by the connection thread right before it exits
+    limit_host_t *host;  // Limits shared with connections from the same address, or NULL
+    arena_t *arena;      // Holds this struct and the connection's buffers until it is reaped
 } socket_options_t;
 
 typedef struct {
-    pthread_mutex_t file_mutex;
-} file_options_t;
-
-typedef struct thread_list {
     pthread_t thread_id;
-    TAILQ_ENTRY(thread_list) threads;
-} thread_list_t;
+    socket_options_t *socket;
+} connection_t;
+
+// Connection threads in the order they were accepted, only used by the main thread
+AESD_RING_DEFINE_DYNAMIC(connection_ring, connection_t, AESD_RING_REJECT)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // Signalled each time a connection thread exits
+    int active;
+} connections_t;
 
-typedef TAILQ_HEAD(head_s, thread_list) thread_list_head_t;
+int aesdsocket_remove_stale_socket(const struct sockaddr_un *address);
 
 #endif
\ No newline at end of file
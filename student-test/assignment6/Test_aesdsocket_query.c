@@ -0,0 +1,157 @@
+// For memmem
+#define _GNU_SOURCE
+
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/aesdsocket-query.h"
+
+#define QUERY_TEST_ROUNDS 2000
+#define QUERY_TEST_MAX_SIZE 512
+
+// Collect the bytes of the matching commands, leaving out iov[0]
+static size_t query_test_gather(const query_result_t *result, char *out)
+{
+    size_t length = 0, i;
+
+    for (i = 1; i < result->count; i++) {
+        memcpy(out + length, result->iov[i].iov_base, result->iov[i].iov_len);
+        length += result->iov[i].iov_len;
+    }
+
+    return length;
+}
+
+static void query_test_find_matches_memmem(size_t pattern_length)
+{
+    static char data[QUERY_TEST_MAX_SIZE];
+    char pattern[64];
+    const char *expected;
+    size_t size, start, i;
+    int round;
+
+    /*
+     * Mostly the same byte, so that candidates passing the first and last byte
+     * screen are common and most of them differ from the pattern in one byte
+     */
+    srand(pattern_length);
+    for (round = 0; round < QUERY_TEST_ROUNDS; round++) {
+        size = rand() % QUERY_TEST_MAX_SIZE;
+        for (i = 0; i < size; i++) {
+            data[i] = "aaaaaaaaaaaaaab\n"[rand() % 16];
+        }
+
+        // The pattern is taken from the data, half the time with one byte changed
+        if (size >= pattern_length) {
+            start = rand() % (size - pattern_length + 1);
+            memcpy(pattern, data + start, pattern_length);
+            if (rand() % 2) {
+                pattern[rand() % pattern_length] ^= 1;
+            }
+        } else {
+            memset(pattern, 'a', pattern_length);
+        }
+
+        expected = memmem(data, size, pattern, pattern_length);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, query_find(data, size, pattern, pattern_length),
+                                      "query_find should find the same occurrence as memmem");
+    }
+}
+
+/**
+ * Verify query_find against memmem over random data, for a single byte
+ * pattern (memchr), the shortest vector screened one, and one longer than an
+ * AVX2 vector so its last byte is loaded from beyond the first vector
+ */
+void test_query_find_matches_memmem()
+{
+    query_test_find_matches_memmem(1);
+    query_test_find_matches_memmem(2);
+    query_test_find_matches_memmem(33);
+    query_test_find_matches_memmem(47);
+}
+
+/**
+ * Verify the empty pattern matches every complete command, but not a partial
+ * command at the end
+ */
+void test_query_match_empty_pattern()
+{
+    const char data[] = "one\ntwo\nthree\npartial";
+    query_t query = { .first = 0, .last = QUERY_LAST, .pattern = "", .pattern_length = 0 };
+    query_result_t result = { 0 };
+    char out[sizeof(data)];
+    size_t length;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    length = query_test_gather(&result, out);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("one\ntwo\nthree\n"), length, "Every complete command should match");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("one\ntwo\nthree\n", out, length, "Every complete command should match");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(length, result.length, "result.length should count the bytes matched");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, result.count, "Consecutive matching commands should be merged into one buffer");
+
+    query_result_free(&result);
+}
+
+/**
+ * Verify a pattern ending in a newline only matches commands ending with the
+ * rest of it, and a newline anywhere else matches nothing
+ */
+void test_query_match_pattern_ending_in_newline()
+{
+    const char data[] = "ab\nb\nbc\nxab\n";
+    query_t query = { .first = 0, .last = QUERY_LAST, .pattern = "b\n", .pattern_length = 2 };
+    query_result_t result = { 0 };
+    char out[sizeof(data)];
+    size_t length;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    length = query_test_gather(&result, out);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("ab\nb\nxab\n"), length, "Commands ending in the pattern should match");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("ab\nb\nxab\n", out, length, "Commands ending in the pattern should match");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, result.count, "The two runs of matching commands should be two buffers");
+
+    query.pattern = "\n";
+    query.pattern_length = 1;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen(data), result.length, "A lone newline should match every command");
+
+    query.pattern = "b\nb";
+    query.pattern_length = 3;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, result.count, "A pattern spanning two commands should match nothing");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, result.length, "A pattern spanning two commands should match nothing");
+
+    query_result_free(&result);
+}
+
+/**
+ * Verify ranges reaching past the newest command are cut at it, and a range
+ * starting past it matches nothing
+ */
+void test_query_match_range_past_end()
+{
+    const char data[] = "a0\na1\na2\n";
+    query_t query = { .first = 1, .last = 10, .pattern = "a", .pattern_length = 1 };
+    query_result_t result = { 0 };
+    char out[sizeof(data)];
+    size_t length;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    length = query_test_gather(&result, out);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("a1\na2\n"), length, "The range should end at the newest command");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("a1\na2\n", out, length, "The range should end at the newest command");
+
+    query.first = 3;
+    query.last = QUERY_LAST;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, result.count, "A range starting past the newest command should match nothing");
+
+    query.first = 7;
+    query.last = 9;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, query_match(&query, data, strlen(data), &result), "query_match should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, result.length, "A range starting past the newest command should match nothing");
+
+    query_result_free(&result);
+}
@@ -0,0 +1,189 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include "../../aesd-char-driver/aesd-ring.h"
+
+#define RING_TEST_CAPACITY 4
+
+struct ring_test_item
+{
+    int value;
+    char tag;
+};
+
+AESD_RING_DEFINE(ring_test_reject, struct ring_test_item, RING_TEST_CAPACITY, AESD_RING_REJECT)
+AESD_RING_DEFINE(ring_test_overwrite, struct ring_test_item, RING_TEST_CAPACITY, AESD_RING_OVERWRITE)
+AESD_RING_DEFINE_DYNAMIC(ring_test_dynamic_reject, struct ring_test_item, AESD_RING_REJECT)
+AESD_RING_DEFINE_DYNAMIC(ring_test_dynamic_overwrite, struct ring_test_item, AESD_RING_OVERWRITE)
+
+static struct ring_test_item ring_test_make(int value)
+{
+    struct ring_test_item item = { .value = value, .tag = (char)('a' + value % 26) };
+
+    return item;
+}
+
+/**
+ * Verify a static ring which rejects pushes fills up to its capacity, refuses
+ * further pushes without touching its contents, and pops oldest first
+ */
+void test_aesd_ring_static_reject()
+{
+    struct ring_test_reject ring;
+    struct ring_test_item item, evicted = ring_test_make(-1);
+    int i;
+
+    ring_test_reject_init(&ring);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_TEST_CAPACITY, ring_test_reject_capacity(&ring), "Capacity should be fixed at compile time");
+    TEST_ASSERT_TRUE_MESSAGE(ring_test_reject_empty(&ring), "A new ring should be empty");
+    TEST_ASSERT_NULL_MESSAGE(ring_test_reject_peek(&ring), "Peeking into an empty ring should return NULL");
+    TEST_ASSERT_FALSE_MESSAGE(ring_test_reject_pop(&ring, &item), "Popping from an empty ring should fail");
+
+    for (i = 0; i < RING_TEST_CAPACITY; i++) {
+        item = ring_test_make(i);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring_test_reject_push(&ring, &item, &evicted),
+                                      "Pushing onto a ring with room should store the item");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(ring_test_reject_full(&ring), "The ring should be full");
+
+    item = ring_test_make(RING_TEST_CAPACITY);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_FULL, ring_test_reject_push(&ring, &item, &evicted),
+                                  "Pushing onto a full rejecting ring should fail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, evicted.value, "A rejected push should not evict anything");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_TEST_CAPACITY, ring_test_reject_count(&ring), "A rejected push should not change the count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, ring_test_reject_peek(&ring)->value, "A rejected push should keep the oldest item");
+
+    for (i = 0; i < RING_TEST_CAPACITY; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(ring_test_reject_pop(&ring, &item), "Popping from a non-empty ring should succeed");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, item.value, "Items should be popped oldest first");
+        TEST_ASSERT_EQUAL_INT_MESSAGE('a' + i, item.tag, "Items should be copied in and out whole");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(ring_test_reject_empty(&ring), "The ring should be empty once every item is popped");
+}
+
+/**
+ * Verify a static ring which overwrites drops its oldest item into evicted
+ * and keeps the newest ones
+ */
+void test_aesd_ring_static_overwrite()
+{
+    struct ring_test_overwrite ring;
+    struct ring_test_item item, evicted;
+    int i;
+
+    ring_test_overwrite_init(&ring);
+    for (i = 0; i < RING_TEST_CAPACITY + 3; i++) {
+        item = ring_test_make(i);
+        if (i < RING_TEST_CAPACITY) {
+            TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring_test_overwrite_push(&ring, &item, &evicted),
+                                          "Pushing onto a ring with room should not evict");
+        } else {
+            TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_EVICTED, ring_test_overwrite_push(&ring, &item, &evicted),
+                                          "Pushing onto a full overwriting ring should evict");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(i - RING_TEST_CAPACITY, evicted.value, "The oldest item should be evicted");
+        }
+    }
+
+    // evicted may be NULL when the caller does not want the dropped item
+    item = ring_test_make(RING_TEST_CAPACITY + 3);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_EVICTED, ring_test_overwrite_push(&ring, &item, NULL),
+                                  "Pushing without an evicted item should still evict");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_TEST_CAPACITY, ring_test_overwrite_count(&ring), "An overwriting ring should stay full");
+    for (i = 0; i < RING_TEST_CAPACITY; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(4 + i, ring_test_overwrite_at(&ring, i)->value,
+                                      "The ring should hold the newest items, oldest first");
+    }
+}
+
+/**
+ * Verify a dynamic ring uses the storage and capacity it is given, with a
+ * capacity that is not a power of two, for both policies
+ */
+void test_aesd_ring_dynamic()
+{
+    struct ring_test_item storage[5], overwrite_storage[5];
+    struct ring_test_dynamic_reject ring;
+    struct ring_test_dynamic_overwrite overwrite;
+    struct ring_test_item item, evicted;
+    int i;
+
+    ring_test_dynamic_reject_init(&ring, storage, 5);
+    ring_test_dynamic_overwrite_init(&overwrite, overwrite_storage, 5);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, ring_test_dynamic_reject_capacity(&ring), "Capacity should be the one given at init");
+
+    for (i = 0; i < 5; i++) {
+        item = ring_test_make(i);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring_test_dynamic_reject_push(&ring, &item, NULL),
+                                      "Pushing onto a dynamic ring with room should store the item");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring_test_dynamic_overwrite_push(&overwrite, &item, NULL),
+                                      "Pushing onto a dynamic ring with room should store the item");
+    }
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(&storage[0], ring_test_dynamic_reject_peek(&ring), "Items should live in the storage given");
+
+    item = ring_test_make(5);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_FULL, ring_test_dynamic_reject_push(&ring, &item, NULL),
+                                  "Pushing onto a full rejecting dynamic ring should fail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_EVICTED, ring_test_dynamic_overwrite_push(&overwrite, &item, &evicted),
+                                  "Pushing onto a full overwriting dynamic ring should evict");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, evicted.value, "The oldest item should be evicted");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, ring_test_dynamic_overwrite_peek(&overwrite)->value, "The next item should become the oldest");
+}
+
+/**
+ * Verify the head and tail wrap around the end of the storage while items are
+ * pushed and popped many times over the capacity
+ */
+void test_aesd_ring_wraparound()
+{
+    struct ring_test_item storage[3];
+    struct ring_test_dynamic_reject ring;
+    struct ring_test_item item;
+    int pushed = 0, popped = 0, round;
+
+    ring_test_dynamic_reject_init(&ring, storage, 3);
+    for (round = 0; round < 20; round++) {
+        // Keep two items in the ring, so the oldest one keeps moving around it
+        while (ring_test_dynamic_reject_count(&ring) < 2) {
+            item = ring_test_make(pushed++);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring_test_dynamic_reject_push(&ring, &item, NULL),
+                                          "Pushing onto a ring with room should store the item");
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(popped + 1, ring_test_dynamic_reject_at(&ring, 1)->value,
+                                      "at() should count from the oldest item across the wrap");
+        TEST_ASSERT_TRUE_MESSAGE(ring_test_dynamic_reject_pop(&ring, &item), "Popping from a non-empty ring should succeed");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(popped++, item.value, "Items should be popped in the order they were pushed");
+        TEST_ASSERT_TRUE_MESSAGE(ring.head < 3, "The head should stay within the storage");
+    }
+}
+
+/**
+ * Verify AESD_RING_FOREACH visits nothing in an empty ring and every item,
+ * oldest first, in a ring which has wrapped around
+ */
+void test_aesd_ring_foreach()
+{
+    struct ring_test_overwrite ring;
+    struct ring_test_item item, *ptr;
+    size_t index;
+    int visited = 0;
+
+    ring_test_overwrite_init(&ring);
+    AESD_RING_FOREACH(ring_test_overwrite, &ring, index, ptr) {
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, visited, "AESD_RING_FOREACH should visit nothing in an empty ring");
+
+    for (visited = 0; visited < RING_TEST_CAPACITY + 2; visited++) {
+        item = ring_test_make(visited);
+        ring_test_overwrite_push(&ring, &item, NULL);
+    }
+
+    visited = 0;
+    AESD_RING_FOREACH(ring_test_overwrite, &ring, index, ptr) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(2 + visited, ptr->value, "AESD_RING_FOREACH should visit the items oldest first");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(visited, index, "index should count the items visited");
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_TEST_CAPACITY, visited, "AESD_RING_FOREACH should visit every item once");
+}
@@ -0,0 +1,66 @@
+#include "unity.h"
+#include <string>
+#include "../../aesd-char-driver/aesd-ring.h"
+
+/*
+ * The test runner is C, so the tests are given C linkage. std::string items
+ * check the wrapper copies non-trivial types in and out properly.
+ */
+extern "C" {
+
+/**
+ * Verify the rejecting C++ ring fills up to its capacity, refuses further
+ * pushes and pops oldest first
+ */
+void test_aesd_ring_cpp_reject()
+{
+    aesd_ring<std::string, 3> ring;
+    std::string item;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, ring.capacity(), "Capacity should be the template argument");
+    TEST_ASSERT_TRUE_MESSAGE(ring.empty(), "A new ring should be empty");
+    TEST_ASSERT_NULL_MESSAGE(ring.peek(), "Peeking into an empty ring should return nullptr");
+    TEST_ASSERT_FALSE_MESSAGE(ring.pop(&item), "Popping from an empty ring should fail");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring.push("one"), "Pushing onto a ring with room should store the item");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring.push("two"), "Pushing onto a ring with room should store the item");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring.push("three"), "Pushing onto a ring with room should store the item");
+    TEST_ASSERT_TRUE_MESSAGE(ring.full(), "The ring should be full");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_FULL, ring.push("four"), "Pushing onto a full rejecting ring should fail");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("one", ring.peek()->c_str(), "A rejected push should keep the oldest item");
+
+    TEST_ASSERT_TRUE_MESSAGE(ring.pop(&item), "Popping from a non-empty ring should succeed");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("one", item.c_str(), "Items should be popped oldest first");
+    TEST_ASSERT_TRUE_MESSAGE(ring.pop(), "Popping without an item should drop the oldest");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("three", ring.peek()->c_str(), "The newest item should be left");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, ring.count(), "One item should be left");
+}
+
+/**
+ * Verify the overwriting C++ ring evicts its oldest item and indexes its
+ * items from the oldest across the wrap
+ */
+void test_aesd_ring_cpp_overwrite()
+{
+    aesd_ring<std::string, 3, AESD_RING_OVERWRITE> ring;
+    std::string evicted;
+    size_t i;
+
+    for (i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_PUSHED, ring.push(std::to_string(i), &evicted),
+                                      "Pushing onto a ring with room should not evict");
+    }
+    for (i = 3; i < 8; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_RING_EVICTED, ring.push(std::to_string(i), &evicted),
+                                      "Pushing onto a full overwriting ring should evict");
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(std::to_string(i - 3).c_str(), evicted.c_str(), "The oldest item should be evicted");
+    }
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, ring.count(), "An overwriting ring should stay full");
+    for (i = 0; i < ring.count(); i++) {
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(std::to_string(5 + i).c_str(), ring.at(i).c_str(),
+                                         "at() should count from the oldest item across the wrap");
+    }
+}
+
+}
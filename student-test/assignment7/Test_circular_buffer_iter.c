@@ -0,0 +1,182 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd_ioctl.h"
+#include "../../aesd-char-driver/aesdchar.h"
+
+#define ITER_TEST_ENTRIES (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3)
+
+/**
+ * Entries of different lengths, so a position landing in the wrong entry is
+ * noticed. Entry i is i + 1 bytes long.
+ */
+static const char *iter_test_strings[] = {
+    "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "ggggggg\n",
+    "hhhhhhhh\n", "iiiiiiiii\n", "jjjjjjjjjj\n", "kkkkkkkkkkk\n", "llllllllllll\n",
+    "mmmmmmmmmmmmm\n",
+};
+
+static void iter_test_add(struct aesd_circular_buffer *buffer, int count)
+{
+    struct aesd_buffer_entry entry;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memset(&entry, 0, sizeof(entry));
+        entry.buffptr = iter_test_strings[i];
+        entry.size = strlen(iter_test_strings[i]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Verify an empty buffer has no entries to iterate over or seek into
+ */
+void test_circular_buffer_iter_empty()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn = 0;
+    int visited = 0;
+
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_circular_buffer_count(&buffer), "An empty buffer should have no entries");
+    aesd_circular_buffer_iter_init(&buffer, &iter);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_next(&buffer, &iter),
+                             "The iterator of an empty buffer should return no entry");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_seek(&buffer, &iter, 0, &offset_rtn),
+                             "Seeking to offset 0 of an empty buffer should find no entry");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_next(&buffer, &iter),
+                             "The iterator should be exhausted after a failed seek");
+    AESD_CIRCULAR_BUFFER_FOREACH_VALID(entry, &buffer, iter) {
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, visited, "AESD_CIRCULAR_BUFFER_FOREACH_VALID should visit no entry of an empty buffer");
+}
+
+/**
+ * Verify the iterator visits the entries of a full buffer which has wrapped
+ * around oldest first, skipping the overwritten ones
+ */
+void test_circular_buffer_iter_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    int expected = ITER_TEST_ENTRIES - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    aesd_circular_buffer_init(&buffer);
+    iter_test_add(&buffer, ITER_TEST_ENTRIES);
+
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "The buffer should be full");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer),
+                                  "A full buffer should hold AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ITER_TEST_ENTRIES % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.out_offs,
+                                  "The oldest entry should have wrapped around");
+
+    AESD_CIRCULAR_BUFFER_FOREACH_VALID(entry, &buffer, iter) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(iter_test_strings[expected], entry->buffptr,
+                                      "The entries should be visited oldest first");
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ITER_TEST_ENTRIES, expected, "Every entry still held should be visited once");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_next(&buffer, &iter),
+                             "The iterator should stay exhausted");
+}
+
+/**
+ * Verify iter_seek in a wrapped buffer at the first and last byte of every
+ * entry, and that the iterator is left on the entry after the one found
+ */
+void test_circular_buffer_iter_seek_boundaries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn, start = 0, size;
+    int i;
+
+    aesd_circular_buffer_init(&buffer);
+    iter_test_add(&buffer, ITER_TEST_ENTRIES);
+
+    for (i = ITER_TEST_ENTRIES - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i < ITER_TEST_ENTRIES; i++) {
+        size = strlen(iter_test_strings[i]);
+
+        entry = aesd_circular_buffer_iter_seek(&buffer, &iter, start, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Seeking to the first byte of an entry should find it");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(iter_test_strings[i], entry->buffptr,
+                                      "Seeking to the first byte of an entry should find that entry");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, offset_rtn, "The first byte of an entry should be at offset 0");
+
+        entry = aesd_circular_buffer_iter_next(&buffer, &iter);
+        if (i + 1 < ITER_TEST_ENTRIES) {
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, "The iterator should continue after the entry found");
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(iter_test_strings[i + 1], entry->buffptr,
+                                          "The iterator should continue with the next entry");
+        } else {
+            TEST_ASSERT_NULL_MESSAGE(entry, "The iterator should end after the newest entry");
+        }
+
+        entry = aesd_circular_buffer_iter_seek(&buffer, &iter, start + size - 1, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Seeking to the last byte of an entry should find it");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(iter_test_strings[i], entry->buffptr,
+                                      "Seeking to the last byte of an entry should find that entry");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(size - 1, offset_rtn, "The last byte of an entry should be at offset size - 1");
+
+        start += size;
+    }
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(buffer.total_size, start, "total_size should add up the entries held");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_seek(&buffer, &iter, buffer.total_size, &offset_rtn),
+                             "Seeking to total_size should find no entry");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_next(&buffer, &iter),
+                             "The iterator should be exhausted after seeking to total_size");
+}
+
+/**
+ * Verify AESDCHAR_IOCSEEKTO only accepts offsets within the command, an offset
+ * equal to the command size is rejected rather than landing on the next one
+ */
+void test_aesdchar_seekto_rejects_offset_past_command()
+{
+    static struct aesd_dev device;
+    struct inode inode = { .i_cdev = &device.cdev };
+    struct file filp;
+    struct aesd_seekto seekto;
+    loff_t pos = 0;
+    int i;
+
+    memset(&filp, 0, sizeof(filp));
+    aesd_dev_init(&device);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_open(&inode, &filp), "aesd_open should succeed");
+    for (i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen(iter_test_strings[i]),
+                                      aesd_write(&filp, iter_test_strings[i], strlen(iter_test_strings[i]), &pos),
+                                      "aesd_write should write the whole command");
+    }
+
+    // "a\n" "bb\n" "ccc\n": command 1 starts at 2 and is 3 bytes long
+    seekto.write_cmd = 1;
+    seekto.write_cmd_offset = 2;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_ioctl(&filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto),
+                                  "Seeking to the last byte of a command should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, filp.f_pos, "The position should be the last byte of command 1");
+
+    seekto.write_cmd_offset = 3;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_ioctl(&filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto),
+                                  "An offset equal to the command size should be rejected");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, filp.f_pos, "A rejected seek should leave the position alone");
+
+    seekto.write_cmd = 3;
+    seekto.write_cmd_offset = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_ioctl(&filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto),
+                                  "A command past the newest should be rejected");
+
+    aesd_release(&inode, &filp);
+    aesd_dev_cleanup(&device);
+}
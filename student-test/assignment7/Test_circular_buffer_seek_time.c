@@ -0,0 +1,175 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd_ioctl.h"
+#include "../../aesd-char-driver/aesdchar.h"
+
+/*
+ * Built once as is and once with AESD_CIRCULAR_BUFFER_SOA by unit-test.sh, the
+ * two layouts work out the position of the entry found differently.
+ */
+
+#define SEEK_TIME_TEST_ENTRIES (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3)
+
+// Entry i is i + 1 bytes long, so a wrong position is noticed
+static const char seek_time_test_data[] = "mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm";
+
+static void seek_time_test_add(struct aesd_circular_buffer *buffer, int i, uint64_t timestamp_ns)
+{
+    struct aesd_buffer_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.buffptr = seek_time_test_data;
+    entry.size = i + 1;
+    entry.timestamp_ns = timestamp_ns;
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Verify entries sharing a timestamp are found from the oldest of them
+ */
+void test_circular_buffer_seek_time_duplicates()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    uint64_t timestamps[] = { 10, 20, 20, 20, 30 };
+    size_t char_offset;
+    int i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < 5; i++) {
+        seek_time_test_add(&buffer, i, timestamps[i]);
+    }
+
+    entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 20, &char_offset);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "An entry with the timestamp searched for should be found");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, entry->seq, "The oldest of the entries sharing the timestamp should be found");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, char_offset, "The position should be the start of that entry");
+    entry = aesd_circular_buffer_iter_next(&buffer, &iter);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, entry->seq, "The iterator should continue after the entry found");
+
+    entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 21, &char_offset);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "A timestamp between two entries should find the later one");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(4, entry->seq, "The entry after the duplicates should be found");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1 + 2 + 3 + 4, char_offset, "The position should be the start of that entry");
+}
+
+/**
+ * Verify a timestamp earlier than the newest entry's is raised to it, so a
+ * clock stepping backwards keeps the timestamps in order for the search
+ */
+void test_circular_buffer_seek_time_clock_steps_back()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    size_t char_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    seek_time_test_add(&buffer, 0, 100);
+    seek_time_test_add(&buffer, 1, 50);
+    seek_time_test_add(&buffer, 2, 200);
+
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(100, buffer.entry[1].timestamp_ns,
+                                     "A timestamp older than the newest entry's should be clamped to it");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(200, buffer.entry[2].timestamp_ns, "Later timestamps should be kept as they are");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, buffer.entry[1].seq, "The clamped entry should still get its sequence number");
+
+    entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 50, &char_offset);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, entry->seq, "Searching for the stepped back time should find the oldest entry");
+
+    entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 101, &char_offset);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, entry->seq, "The clamped entry should not be found after its predecessor's time");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1 + 2, char_offset, "The position should be the start of that entry");
+}
+
+/**
+ * Verify every entry of a buffer which has wrapped around is found at its
+ * position, and that a time before the oldest entry finds the oldest entry
+ */
+void test_circular_buffer_seek_time_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_buffer_entry *entry;
+    size_t char_offset, start = 0;
+    int first = SEEK_TIME_TEST_ENTRIES - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    int i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < SEEK_TIME_TEST_ENTRIES; i++) {
+        seek_time_test_add(&buffer, i, 1000 + 10 * i);
+    }
+
+    entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 0, &char_offset);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "A time before the oldest entry should find the oldest entry");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(first, entry->seq, "A time before the oldest entry should find the oldest entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, char_offset, "The oldest entry should be at position 0");
+
+    for (i = first; i < SEEK_TIME_TEST_ENTRIES; i++) {
+        // Halfway from the previous entry's time finds this entry too
+        entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 1000 + 10 * i - 5, &char_offset);
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(i, entry->seq, "A time after the previous entry should find the next one");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(start, char_offset, "The position should be the start of the entry");
+
+        entry = aesd_circular_buffer_iter_seek_time(&buffer, &iter, 1000 + 10 * i, &char_offset);
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(i, entry->seq, "An entry's own time should find it");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(start, char_offset, "The position should be the start of the entry");
+
+        start += i + 1;
+    }
+}
+
+/**
+ * Verify a time after the newest entry finds nothing and positions at the end
+ * of the data, in the buffer and through AESDCHAR_IOCSEEKTIME, which returns
+ * the sequence number the next command will get
+ */
+void test_circular_buffer_seek_time_after_newest()
+{
+    static struct aesd_dev device;
+    struct inode inode = { .i_cdev = &device.cdev };
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_iter iter;
+    struct aesd_seektime seektime;
+    struct file filp;
+    size_t char_offset;
+    loff_t pos = 0;
+    int i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < SEEK_TIME_TEST_ENTRIES; i++) {
+        seek_time_test_add(&buffer, i, 1000 + 10 * i);
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_seek_time(&buffer, &iter, 1000 + 10 * SEEK_TIME_TEST_ENTRIES, &char_offset),
+                             "A time after the newest entry should find no entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(buffer.total_size, char_offset, "The position should be the end of the data");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_iter_next(&buffer, &iter), "The iterator should be exhausted");
+
+    memset(&filp, 0, sizeof(filp));
+    aesd_dev_init(&device);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_open(&inode, &filp), "aesd_open should succeed");
+    for (i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(2, aesd_write(&filp, "x\n", 2, &pos), "aesd_write should write the whole command");
+    }
+
+    memset(&seektime, 0, sizeof(seektime));
+    seektime.timestamp_ns = UINT64_MAX;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_ioctl(&filp, AESDCHAR_IOCSEEKTIME, (unsigned long)&seektime),
+                                  "AESDCHAR_IOCSEEKTIME should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, filp.f_pos, "The position should be the end of the data");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(3, seektime.seq, "The sequence number should be the next command's");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, seektime.found_timestamp_ns, "No timestamp should be returned");
+
+    seektime.timestamp_ns = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_ioctl(&filp, AESDCHAR_IOCSEEKTIME, (unsigned long)&seektime),
+                                  "AESDCHAR_IOCSEEKTIME should succeed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, filp.f_pos, "A time before every command should position at the start");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, seektime.seq, "The oldest command should be found");
+
+    aesd_release(&inode, &filp);
+    aesd_dev_cleanup(&device);
+}
@@ -11,3 +11,14 @@ make clean
 make
 cd ..
 ./build/assignment-autotest/assignment-autotest
+rc=$?
+
+# Again with the circular buffer built with its structure-of-arrays layout
+mkdir -p build-soa
+cd build-soa
+cmake -DAESD_CIRCULAR_BUFFER_SOA=ON ..
+make clean
+make
+cd ..
+./build-soa/assignment-autotest/assignment-autotest || rc=$?
+exit $rc